@@ -0,0 +1,262 @@
+//
+// Coroutine executor and async client transfers for libtftp.
+//
+
+#include <cerrno>
+#include <sys/epoll.h>
+#include "TftpAsync.h"
+
+EventLoop::EventLoop()
+{
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0)
+        perror("epoll_create1 failed");
+}
+
+EventLoop::~EventLoop()
+{
+    for (std::coroutine_handle<> task : tasks)
+        task.destroy();
+    if (epollFd >= 0)
+        close(epollFd);
+}
+
+void EventLoop::spawn(Task<void> task)
+{
+    std::coroutine_handle<> handle = task.release();
+    tasks.push_back(handle);
+    ready.push_back(handle);
+}
+
+void EventLoop::wait(ReadableAwaiter *waiter, std::coroutine_handle<> handle)
+{
+    waiter->handle = handle;
+    waiter->timer = timers.end();
+    if (waiter->deadline != time_point::max())
+        waiter->timer = timers.emplace(waiter->deadline, waiter);
+
+    // One-shot registration, re-armed on every wait
+    struct epoll_event event = {};
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = waiter->fd;
+    bool known = registered.count(waiter->fd) != 0;
+    if (epoll_ctl(epollFd, known ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, waiter->fd, &event) != 0)
+    {
+        // Without readiness the transfer can still make progress through its timer
+        perror("epoll_ctl failed");
+    }
+    registered.insert(waiter->fd);
+    waiting[waiter->fd] = waiter;
+}
+
+void EventLoop::wake(ReadableAwaiter *waiter, bool readable)
+{
+    waiter->readable = readable;
+    if (waiter->timer != timers.end())
+        timers.erase(waiter->timer);
+    waiting.erase(waiter->fd);
+    ready.push_back(waiter->handle);
+}
+
+void EventLoop::forget(int fd)
+{
+    if (registered.erase(fd) != 0)
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void EventLoop::run()
+{
+    struct epoll_event events[256];
+
+    while (!tasks.empty())
+    {
+        // Resume everything that became runnable; resuming may queue more
+        while (!ready.empty())
+        {
+            std::vector<std::coroutine_handle<>> runnable;
+            runnable.swap(ready);
+            for (std::coroutine_handle<> handle : runnable)
+                handle.resume();
+        }
+
+        // Destroy finished tasks
+        for (size_t i = 0; i < tasks.size();)
+        {
+            if (tasks[i].done())
+            {
+                tasks[i].destroy();
+                tasks[i] = tasks.back();
+                tasks.pop_back();
+            }
+            else
+                i++;
+        }
+        if (tasks.empty())
+            break;
+
+        // Sleep until a socket is readable or the earliest timer is due
+        int timeoutMs = -1;
+        if (!timers.empty())
+        {
+            auto remaining = timers.begin()->first - std::chrono::steady_clock::now();
+            timeoutMs = remaining <= std::chrono::steady_clock::duration::zero()
+                            ? 0
+                            : std::chrono::ceil<std::chrono::milliseconds>(remaining).count();
+        }
+        else if (waiting.empty())
+        {
+            std::cerr << "Event loop stalled: tasks are suspended on something other than the loop" << std::endl;
+            return;
+        }
+
+        int count = epoll_wait(epollFd, events, 256, timeoutMs);
+        if (count < 0 && errno != EINTR)
+        {
+            perror("epoll_wait failed");
+            return;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            auto it = waiting.find(events[i].data.fd);
+            if (it != waiting.end())
+                wake(it->second, true);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        while (!timers.empty() && timers.begin()->first <= now)
+            wake(timers.begin()->second, false);
+    }
+}
+
+namespace
+{
+    // Open a non-blocking UDP socket on an ephemeral port for one transfer
+    int openTransferSocket()
+    {
+        int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sockfd < 0)
+            return -1;
+
+        struct sockaddr_in cli_addr;
+        memset(&cli_addr, 0, sizeof(cli_addr));
+        cli_addr.sin_family = AF_INET;
+        cli_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        cli_addr.sin_port = htons(0);
+        if (bind(sockfd, (struct sockaddr *)&cli_addr, sizeof(cli_addr)) < 0)
+        {
+            close(sockfd);
+            return -1;
+        }
+        return sockfd;
+    }
+
+    TransferResult socketFailure()
+    {
+        TransferResult result;
+        result.errorCode = TFTP_ERROR_TRANSPORT;
+        result.errorMessage = std::string("Unable to open socket: ") + strerror(errno);
+        return result;
+    }
+
+    template <typename Engine>
+    TransferResult resultOf(const Engine &engine)
+    {
+        TransferResult result;
+        result.ok = engine.state() == TransferState::Complete;
+        result.errorCode = engine.errorCode();
+        result.errorMessage = engine.errorMessage();
+        result.failedByPeer = engine.failedByPeer();
+        result.stats = engine.stats();
+        return result;
+    }
+
+    // The async counterpart of runTransfer(): suspend until the socket is readable or the engine's timer
+    // is due, then feed the engine every queued packet or the timeout
+    template <typename Engine>
+    Task<void> driveTransfer(EventLoop &loop, int sockfd, UdpTransport &transport, Engine &engine)
+    {
+        TftpPacketUnion packet;
+        while (engine.active())
+        {
+            bool readable = co_await loop.readable(sockfd, engine.deadline());
+            if (!readable)
+            {
+                engine.onTimeout();
+                continue;
+            }
+
+            while (engine.active())
+            {
+                ssize_t length = transport.tryReceive(packet);
+                if (length == TRANSPORT_WOULD_BLOCK)
+                    break;
+                if (length < 0)
+                    engine.abort(TFTP_ERROR_TRANSPORT, "Unable to receive packet");
+                else
+                    engine.onPacket(packet, length);
+            }
+        }
+        loop.forget(sockfd);
+    }
+}
+
+Task<TransferResult> TftpAsyncClient::get(std::string remoteName, std::string localPath)
+{
+    int sockfd = openTransferSocket();
+    if (sockfd < 0)
+        co_return socketFailure();
+
+    // The file is created with the first block, so an error reply leaves nothing behind
+    std::ofstream file;
+    UdpTransport transport(sockfd, serv_addr, true);
+    SteadyClock clock;
+    TftpReceiver<UdpTransport, SteadyClock> receiver(transport, clock, [&file, &localPath](const char *data, size_t length)
+                                                     {
+                                                         if (!file.is_open())
+                                                             file.open(localPath, std::ios::binary);
+                                                         file.write(data, length);
+                                                         return file.good();
+                                                     });
+    receiver.startWithRequest(remoteName.c_str());
+    co_await driveTransfer(loop, sockfd, transport, receiver);
+    close(sockfd);
+
+    bool created = file.is_open();
+    file.close();
+    if (receiver.state() != TransferState::Complete && created)
+        remove(localPath.c_str());
+
+    co_return resultOf(receiver);
+}
+
+Task<TransferResult> TftpAsyncClient::put(std::string remoteName, std::string localPath)
+{
+    std::ifstream file(localPath, std::ios::binary);
+    if (!file.is_open())
+    {
+        TransferResult result;
+        result.errorCode = TFTP_ERROR_FILE_NOT_FOUND;
+        result.errorMessage = "Unable to open " + localPath;
+        co_return result;
+    }
+
+    int sockfd = openTransferSocket();
+    if (sockfd < 0)
+        co_return socketFailure();
+
+    UdpTransport transport(sockfd, serv_addr, true);
+    SteadyClock clock;
+    TftpSender<UdpTransport, SteadyClock> sender(transport, clock, [&file](char *buffer) -> ssize_t
+                                                 {
+                                                     file.read(buffer, MAX_DATA_LEN);
+                                                     if (file.bad())
+                                                         return -1;
+                                                     return file.gcount();
+                                                 });
+    sender.startWithRequest(remoteName.c_str());
+    co_await driveTransfer(loop, sockfd, transport, sender);
+    close(sockfd);
+
+    co_return resultOf(sender);
+}
@@ -0,0 +1,206 @@
+// TftpAsync.h
+//
+// Coroutine API for embedding TFTP transfers in another program (C++20, libtftp). Transfers run the engines
+// from TftpTransfer.h on a single-threaded EventLoop that suspends them on socket readiness and timers, so one
+// thread can drive thousands of transfers. Every outcome, including timeouts and socket failures, comes back
+// as a TransferResult; nothing in the library exits the process.
+//
+//   Task<void> fetch(TftpAsyncClient &client)
+//   {
+//       TransferResult result = co_await client.get("server-to-client-small.txt", "client-files/small.txt");
+//       ...
+//   }
+//
+//   EventLoop loop;
+//   TftpAsyncClient client(loop, serv_addr);
+//   loop.spawn(fetch(client));
+//   loop.run();
+//
+// Each transfer holds one socket, so the process file descriptor limit bounds how many can run at once.
+#ifndef TFTP_ASYNC_H
+#define TFTP_ASYNC_H
+
+#include <coroutine>
+#include <exception>
+#include <map>
+#include <optional>
+#include <set>
+#include <utility>
+#include <vector>
+#include "TftpTransfer.h"
+
+// Outcome of one transfer
+struct TransferResult
+{
+    bool ok = false;
+    int errorCode = TFTP_ERROR_NOT_DEFINED; // TFTP error code, or TFTP_ERROR_TIMEOUT / TFTP_ERROR_TRANSPORT
+    std::string errorMessage;
+    bool failedByPeer = false; // the error came in an ERROR packet from the server
+    TransferStats stats;
+};
+
+template <typename T>
+class Task;
+
+// Shared by every Task promise: a finished coroutine resumes whoever awaited it
+struct TaskPromiseBase
+{
+    std::coroutine_handle<> continuation;
+
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            std::coroutine_handle<> next = handle.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    // Errors are reported as values, so an escaping exception is a bug
+    void unhandled_exception() { std::terminate(); }
+};
+
+// A lazily started coroutine producing a T. co_await starts it and resumes the awaiter when it finishes.
+template <typename T>
+class Task
+{
+public:
+    struct promise_type : TaskPromiseBase
+    {
+        std::optional<T> value;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_value(T result) { value = std::move(result); }
+    };
+
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task(const Task &) = delete;
+    ~Task()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+    {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+    T await_resume() { return std::move(*handle.promise().value); }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <>
+class Task<void>
+{
+public:
+    struct promise_type : TaskPromiseBase
+    {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_void() {}
+    };
+
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task(const Task &) = delete;
+    ~Task()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+    {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+    void await_resume() {}
+
+    // Hand the coroutine over to an owner that destroys it once done()
+    std::coroutine_handle<> release() { return std::exchange(handle, nullptr); }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Single-threaded executor. Coroutines suspend on a socket becoming readable or a deadline passing, and
+// run() resumes them from epoll_wait until every spawned task has finished.
+class EventLoop
+{
+public:
+    using time_point = std::chrono::steady_clock::time_point;
+
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop &) = delete;
+
+    // Start a task on the next run(). The loop owns it and destroys it when it finishes.
+    void spawn(Task<void> task);
+
+    // Run until every spawned task has finished
+    void run();
+
+    // Awaitable that resumes with true once fd is readable, or false once deadline passes first
+    struct ReadableAwaiter
+    {
+        EventLoop &loop;
+        int fd;
+        time_point deadline;
+        std::coroutine_handle<> handle = nullptr;
+        bool readable = false;
+        std::multimap<time_point, ReadableAwaiter *>::iterator timer{};
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> awaiter) { loop.wait(this, awaiter); }
+        bool await_resume() const noexcept { return readable; }
+    };
+    ReadableAwaiter readable(int fd, time_point deadline) { return ReadableAwaiter{*this, fd, deadline}; }
+
+    // Stop watching fd before it is closed
+    void forget(int fd);
+
+private:
+    void wait(ReadableAwaiter *waiter, std::coroutine_handle<> handle);
+    void wake(ReadableAwaiter *waiter, bool readable);
+
+    int epollFd;
+    std::map<int, ReadableAwaiter *> waiting; // by fd
+    std::set<int> registered;                 // fds added to epoll
+    std::multimap<time_point, ReadableAwaiter *> timers;
+    std::vector<std::coroutine_handle<>> ready;
+    std::vector<std::coroutine_handle<>> tasks;
+};
+
+// Client side of RRQ and WRQ transfers with one server. Must outlive the transfers it starts.
+class TftpAsyncClient
+{
+public:
+    TftpAsyncClient(EventLoop &loop, const struct sockaddr_in &serv_addr) : loop(loop), serv_addr(serv_addr) {}
+
+    // Read remoteName from the server into localPath. A failed read leaves no local file behind.
+    Task<TransferResult> get(std::string remoteName, std::string localPath);
+
+    // Write localPath to the server as remoteName
+    Task<TransferResult> put(std::string remoteName, std::string localPath);
+
+private:
+    EventLoop &loop;
+    struct sockaddr_in serv_addr;
+};
+
+#endif
@@ -0,0 +1,59 @@
+//
+// TFTP batch client - reads or writes many files concurrently from one thread using libtftp.
+//
+// Usage: ./tftp-batch <r|w> <filename>...
+
+#include "TftpAsync.h"
+
+#define SERV_UDP_PORT 61125
+#define SERV_HOST_ADDR "127.0.0.1"
+
+char *program;
+
+int failures = 0;
+
+// Transfer one file and print how it went
+Task<void> transferFile(TftpAsyncClient &client, char requestType, std::string filename)
+{
+    std::string filePath = std::string(CLIENT_FOLDER) + filename;
+    TransferResult result;
+    if (requestType == 'r')
+        result = co_await client.get(filename, filePath);
+    else
+        result = co_await client.put(filename, filePath);
+
+    if (result.ok)
+        std::cout << filename << ": " << result.stats.bytes << " bytes, " << result.stats.retransmits << " retransmits" << std::endl;
+    else
+    {
+        failures++;
+        std::cout << filename << ": failed, error code " << result.errorCode << ", " << result.errorMessage << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    program = argv[0];
+    startTracing(1);
+
+    // Verify arguments
+    if (argc < 3 || (strcmp(argv[1], "r") != 0 && strcmp(argv[1], "w") != 0))
+    {
+        std::cerr << "Usage: " << argv[0] << " <r|w> <filename>..." << std::endl;
+        return 1;
+    }
+
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = inet_addr(SERV_HOST_ADDR);
+    serv_addr.sin_port = htons(resolvePort("TFTP_SERVER_PORT", SERV_UDP_PORT));
+
+    EventLoop loop;
+    TftpAsyncClient client(loop, serv_addr);
+    for (int i = 2; i < argc; i++)
+        loop.spawn(transferFile(client, argv[1][0], argv[i]));
+    loop.run();
+
+    return failures == 0 ? 0 : 3;
+}
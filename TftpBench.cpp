@@ -0,0 +1,371 @@
+//
+// TFTP protocol benchmark - runs WRQ-style transfers between the sender and receiver engines over the
+// in-memory lossy network, with no sockets, and checks every received file against what was sent.
+//
+// Usage: ./tftp-bench [size=BYTES] [runs=N] [loss=PPM] [dup=PPM] [latency=US] [jitter=US] [seed=N]
+//        ./tftp-bench sessions=N [rrq=0|1] [slab=0|1] [cap=N] [size=BYTES] ...
+//
+// With sessions=N it instead runs N short WRQ (or with rrq=1, RRQ) sessions the way tftp-server serves them,
+// keeping the session state in a SessionSlab (slab=1) or allocating it per request (slab=0), and reports
+// sessions/sec and the bytes each session uses, counting the heap from accept to close.
+
+#include <fcntl.h>
+#include <new>
+#include "TftpLoopback.h"
+#include "TftpSession.h"
+
+char *program;
+
+static const char *BENCH_WRQ_FILENAME = "client-to-server-bench.txt";
+static const char *BENCH_RRQ_FILENAME = "server-to-client-bench.txt";
+
+// Heap use while countingHeap is set. The session benchmark sets it for a whole session and BenchTransport
+// clears it while a packet is queued, so the in-memory network is left out. Atomic because RRQ sessions
+// start a prefetch thread.
+std::atomic<bool> countingHeap{false};
+std::atomic<uint64_t> heapAllocations{0};
+std::atomic<uint64_t> heapBytes{0};
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    if (countingHeap.load(std::memory_order_relaxed))
+    {
+        heapAllocations.fetch_add(1, std::memory_order_relaxed);
+        heapBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    if (void *memory = malloc(size))
+        return memory;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *memory) noexcept { free(memory); }
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept { free(memory); }
+
+// MemoryTransport that does not count what the in-memory network allocates to queue a packet
+class BenchTransport
+{
+public:
+    BenchTransport(MemoryNetwork &network, int side) : transport(network, side) {}
+
+    bool send(const void *packet, size_t length)
+    {
+        bool counting = countingHeap.exchange(false, std::memory_order_relaxed);
+        bool sent = transport.send(packet, length);
+        countingHeap.store(counting, std::memory_order_relaxed);
+        return sent;
+    }
+
+private:
+    MemoryTransport transport;
+};
+
+struct BenchOptions
+{
+    size_t fileSize = 1024 * 1024;
+    unsigned int runs = 20;
+    LinkConditions conditions;
+    uint64_t seed = 1;
+    unsigned int sessions = 0; // run the session benchmark instead when set
+    bool slab = true;
+    bool rrq = false; // sessions read a file instead of writing one
+    size_t sessionCap = DEFAULT_MAX_SESSIONS;
+};
+
+bool parseOption(BenchOptions &options, const std::string &arg)
+{
+    size_t equals = arg.find('=');
+    if (equals == std::string::npos)
+        return false;
+
+    std::string key = arg.substr(0, equals);
+    unsigned long long value = strtoull(arg.c_str() + equals + 1, nullptr, 10);
+    if (key == "size")
+        options.fileSize = value;
+    else if (key == "runs")
+        options.runs = value;
+    else if (key == "loss")
+        options.conditions.lossPpm = value;
+    else if (key == "dup")
+        options.conditions.duplicatePpm = value;
+    else if (key == "latency")
+        options.conditions.latency = std::chrono::microseconds(value);
+    else if (key == "jitter")
+        options.conditions.jitter = std::chrono::microseconds(value);
+    else if (key == "seed")
+        options.seed = value;
+    else if (key == "sessions")
+        options.sessions = value;
+    else if (key == "slab")
+        options.slab = value != 0;
+    else if (key == "rrq")
+        options.rrq = value != 0;
+    else if (key == "cap")
+        options.sessionCap = std::max(value, 1ULL);
+    else
+        return false;
+    return true;
+}
+
+// The client end of one bench session and the in-memory network between it and the server. It is built
+// before heap counting starts, since only the server's side of a session is measured.
+struct BenchClient
+{
+    VirtualClock clock;
+    MemoryNetwork network;
+    BenchTransport clientSide, serverSide;
+    const std::vector<char> &file;
+    size_t offset = 0;
+    TftpSender<BenchTransport, VirtualClock> sender;     // uploads file for a WRQ
+    TftpReceiver<BenchTransport, VirtualClock> receiver; // checks the blocks of an RRQ against file
+
+    BenchClient(const std::vector<char> &file, const BenchOptions &options, uint64_t seed)
+        : network(clock, options.conditions, seed), clientSide(network, 0), serverSide(network, 1), file(file),
+          sender(clientSide, clock, [this](char *buffer) -> ssize_t
+                 {
+                     size_t length = std::min(this->file.size() - offset, static_cast<size_t>(MAX_DATA_LEN));
+                     memcpy(buffer, this->file.data() + offset, length);
+                     offset += length;
+                     return length;
+                 }),
+          receiver(clientSide, clock, [this](const char *data, size_t length)
+                   {
+                       bool same = offset + length <= this->file.size() && memcmp(this->file.data() + offset, data, length) == 0;
+                       offset += length;
+                       return same;
+                   })
+    {
+    }
+
+    BenchClient(const BenchClient &) = delete;
+    BenchClient &operator=(const BenchClient &) = delete;
+
+    // Send the request and run it against the started server engine. Returns true if both ends completed.
+    template <typename Server>
+    bool run(bool rrq, const char *filename, Server &server)
+    {
+        if (!rrq)
+        {
+            sender.startWithRequest(filename);
+            return runSimulation(network, clock, sender, server);
+        }
+        receiver.startWithRequest(filename);
+        return runSimulation(network, clock, receiver, server) && offset == file.size();
+    }
+};
+
+// Serve a request that has been accepted into filename and path the way tftp-server does: an RRQ reads
+// path through a FilePrefetcher, a WRQ hands each block to sink. Returns false if the transfer failed.
+template <typename Sink>
+bool serveRequest(BenchClient &client, bool rrq, const char *filename, const char *path, Sink sink)
+{
+    if (rrq)
+    {
+        FilePrefetcher source(path);
+        if (!source.isOpen())
+            return false;
+        TftpSender<BenchTransport, VirtualClock> sender(client.serverSide, client.clock, [&source](char *buffer)
+                                                        { return source.nextBlock(buffer); });
+        sender.start();
+        return client.run(true, filename, sender);
+    }
+
+    TftpReceiver<BenchTransport, VirtualClock> receiver(client.serverSide, client.clock, sink);
+    receiver.start();
+    return client.run(false, filename, receiver);
+}
+
+// One session with its state in a slab record, counted from accept to close. The path is built in folder
+// as the server builds it in SERVER_FOLDER, but a WRQ writes to /dev/null.
+bool runSlabSession(SessionRecord &session, const std::vector<char> &file, const BenchOptions &options, const char *folder, uint64_t seed)
+{
+    BenchClient client(file, options, seed);
+
+    countingHeap = true;
+    session.requestLength = buildRequestPacket(session.request, options.rrq ? TFTP_RRQ : TFTP_WRQ,
+                                               options.rrq ? BENCH_RRQ_FILENAME : BENCH_WRQ_FILENAME);
+    const char *filename = session.filename();
+    bool ok = filename != nullptr && session.setPath(folder, filename);
+    int fd = ok && !options.rrq ? open("/dev/null", O_WRONLY | O_CLOEXEC) : -1;
+    ok = ok && (options.rrq || fd >= 0) &&
+         serveRequest(client, options.rrq, filename, session.path, [&session, fd](const char *data, size_t length)
+                      {
+                          return session.bufferWrite(fd, data, length) &&
+                                 (length == MAX_DATA_LEN || session.flushWrites(fd));
+                      });
+    if (fd >= 0)
+        close(fd);
+    countingHeap = false;
+    return ok;
+}
+
+// The same session with its state allocated per request, as the server did before SessionSlab
+bool runHeapSession(const std::vector<char> &file, const BenchOptions &options, const char *folder, uint64_t seed)
+{
+    BenchClient client(file, options, seed);
+
+    countingHeap = true;
+    TftpPacketUnion *request = new TftpPacketUnion();
+    buildRequestPacket(*request, options.rrq ? TFTP_RRQ : TFTP_WRQ, options.rrq ? BENCH_RRQ_FILENAME : BENCH_WRQ_FILENAME);
+    const char *filename = request->requestPacket.filename;
+    std::string filePath = std::string(folder) + filename;
+    std::ofstream *output = options.rrq ? nullptr : new std::ofstream("/dev/null", std::ios::binary);
+    bool ok = (options.rrq || output->good()) &&
+              serveRequest(client, options.rrq, filename, filePath.c_str(), [output](const char *data, size_t length)
+                           {
+                               output->write(data, length);
+                               return output->good();
+                           });
+    delete output;
+    delete request;
+    countingHeap = false;
+    return ok;
+}
+
+int runSessionBench(const BenchOptions &options, const std::vector<char> &file)
+{
+    // RRQ sessions read file from a scratch folder, the way the server reads from SERVER_FOLDER
+    char scratch[] = "/tmp/tftp-bench-XXXXXX";
+    std::string folder = SERVER_FOLDER;
+    std::string filePath;
+    if (options.rrq)
+    {
+        if (mkdtemp(scratch) == nullptr)
+        {
+            perror("Unable to create bench folder");
+            return 1;
+        }
+        folder = std::string(scratch) + "/";
+        filePath = folder + BENCH_RRQ_FILENAME;
+        std::ofstream output(filePath, std::ios::binary);
+        output.write(file.data(), file.size());
+        if (!output.good())
+        {
+            perror("Unable to write bench file");
+            return 1;
+        }
+    }
+
+    SessionSlab slab(options.slab ? options.sessionCap : 0);
+    unsigned int failures = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned int i = 0; i < options.sessions; i++)
+    {
+        bool ok;
+        if (options.slab)
+        {
+            SessionRecord *session = slab.acquire();
+            ok = session != nullptr && runSlabSession(*session, file, options, folder.c_str(), options.seed + i);
+            if (session != nullptr)
+                slab.release(session);
+        }
+        else
+            ok = runHeapSession(file, options, folder.c_str(), options.seed + i);
+        if (!ok)
+            failures++;
+    }
+
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t recordBytes = options.slab ? SessionSlab::bytesPerSession() : 0;
+    uint64_t sessionHeap = heapBytes / options.sessions;
+
+    if (options.rrq)
+    {
+        unlink(filePath.c_str());
+        rmdir(scratch);
+    }
+
+    std::cout << options.sessions << (options.rrq ? " RRQ" : " WRQ") << " sessions of " << file.size() << " bytes, session state "
+              << (options.slab ? "from a slab" : "allocated per request") << std::endl;
+    std::cout << "Sessions/sec: " << static_cast<uint64_t>(options.sessions / wallSeconds) << std::endl;
+    std::cout << "Bytes per session: " << recordBytes + sessionHeap << " (slab record " << recordBytes << ", heap " << sessionHeap
+              << " in " << static_cast<double>(heapAllocations) / options.sessions << " allocations from accept to close)" << std::endl;
+    if (options.slab)
+        std::cout << "Slab for " << slab.capacity() << " sessions: " << slab.capacity() * recordBytes << " bytes" << std::endl;
+    std::cout << "Failed: " << failures << std::endl;
+
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    program = argv[0];
+
+    BenchOptions options;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!parseOption(options, argv[i]))
+        {
+            std::cerr << "Usage: " << argv[0] << " [size=BYTES] [runs=N] [loss=PPM] [dup=PPM] [latency=US] [jitter=US] [seed=N]" << std::endl
+                      << "       " << argv[0] << " sessions=N [rrq=0|1] [slab=0|1] [cap=N] [size=BYTES] ..." << std::endl;
+            return 1;
+        }
+    }
+
+    // The same file is sent on every run, generated from the seed
+    std::vector<char> file(options.fileSize);
+    std::mt19937_64 rng(options.seed);
+    for (char &byte : file)
+        byte = static_cast<char>(rng());
+
+    if (options.sessions > 0)
+        return runSessionBench(options, file);
+
+    unsigned int failures = 0, corrupted = 0;
+    uint64_t packets = 0, retransmits = 0;
+    std::chrono::steady_clock::duration virtualTime{0};
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned int run = 0; run < options.runs; run++)
+    {
+        VirtualClock clock;
+        MemoryNetwork network(clock, options.conditions, options.seed + run);
+        MemoryTransport senderSide(network, 0), receiverSide(network, 1);
+
+        size_t offset = 0;
+        TftpSender<MemoryTransport, VirtualClock> sender(senderSide, clock, [&file, &offset](char *buffer) -> ssize_t
+                                                         {
+                                                             size_t length = std::min(file.size() - offset, static_cast<size_t>(MAX_DATA_LEN));
+                                                             memcpy(buffer, file.data() + offset, length);
+                                                             offset += length;
+                                                             return length;
+                                                         });
+
+        std::vector<char> received;
+        received.reserve(file.size());
+        TftpReceiver<MemoryTransport, VirtualClock> receiver(receiverSide, clock, [&received](const char *data, size_t length)
+                                                             {
+                                                                 received.insert(received.end(), data, data + length);
+                                                                 return true;
+                                                             });
+
+        // As if the server had just accepted the WRQ: the request and ACK 0 cross on the network
+        sender.startWithRequest("bench");
+        receiver.start();
+
+        if (!runSimulation(network, clock, sender, receiver))
+        {
+            failures++;
+            std::cout << "Run " << run << " failed: " << sender.errorMessage() << " / " << receiver.errorMessage() << std::endl;
+        }
+        else if (received != file)
+            corrupted++;
+
+        packets += network.stats().delivered;
+        retransmits += sender.stats().retransmits + receiver.stats().retransmits;
+        virtualTime += clock.now().time_since_epoch();
+    }
+
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double simulatedSeconds = std::chrono::duration<double>(virtualTime).count();
+
+    std::cout << options.runs << " transfers of " << options.fileSize << " bytes, loss " << options.conditions.lossPpm
+              << " ppm, dup " << options.conditions.duplicatePpm << " ppm, seed " << options.seed << std::endl;
+    std::cout << "Packets delivered: " << packets << " (" << static_cast<uint64_t>(packets / wallSeconds) << " packets/sec)" << std::endl;
+    std::cout << "Retransmits: " << retransmits << std::endl;
+    std::cout << "Simulated time: " << simulatedSeconds << " s, goodput "
+              << (simulatedSeconds > 0 ? options.runs * options.fileSize / simulatedSeconds / 1024 : 0) << " KiB/s" << std::endl;
+    std::cout << "Failed: " << failures << ", corrupted: " << corrupted << std::endl;
+
+    return failures == 0 && corrupted == 0 ? 0 : 1;
+}
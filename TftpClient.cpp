@@ -3,7 +3,7 @@
 //
 // TFTP client program - CSS 432 - Winter 2024
 
-#include "TftpCommon.h"
+#include "TftpTransfer.h"
 
 #define SERV_UDP_PORT 61125
 #define SERV_HOST_ADDR "127.0.0.1"
@@ -11,170 +11,82 @@
 /* A pointer to the name of this program for error reporting.      */
 char *program;
 
-void handleFirstReceivedPacket(int sockfd, struct sockaddr_in serv_addr, TftpPacketUnion &receivedPkt, socklen_t serLen)
+// Report a failed transfer and exit, the way an ERROR packet from the server always has
+template <typename Engine>
+void handleTransferResult(const Engine &engine, int sockfd)
 {
-    ssize_t rcvFirstBytes = recvfrom(sockfd, &receivedPkt, sizeof(receivedPkt), 0,
-                                     (struct sockaddr *)&serv_addr, &serLen);
-    if (rcvFirstBytes == -1)
-    {
-        perror("Error receiving first TFTP packet");
-        close(sockfd);
+    if (engine.state() == TransferState::Complete)
         return;
-    }
 
-    // Handle error packet received
-    uint16_t opcode = ntohs(receivedPkt.packet.opcode);
-    if (opcode == TFTP_ERROR)
-    {
-        std::cout << "Received TFTP error packet. Error Code: " << ntohs(receivedPkt.errorPacket.errorCode)
-                  << ", Error Message: " << receivedPkt.errorPacket.errorMessage << std::endl;
-        exit(3);
-    }
+    if (engine.failedByPeer())
+        std::cout << "Received TFTP error packet. Error Code: " << engine.errorCode()
+                  << ", Error Message: " << engine.errorMessage() << std::endl;
+    else
+        std::cerr << "Transfer failed: " << engine.errorMessage() << std::endl;
+
+    close(sockfd);
+    exit(3);
 }
 
-void processRRQ(int sockfd, struct sockaddr_in serv_addr, std::string filePath)
+// Print how long the request took, from sending it to the first block and to the end of the transfer
+void reportLatency(const TransferStats &stats)
 {
-    TftpPacketUnion receivedPkt;
-    socklen_t serLen = sizeof(serv_addr);
-
-    handleFirstReceivedPacket(sockfd, serv_addr, receivedPkt, serLen);
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    std::cout << "Latency: first block " << duration_cast<microseconds>(stats.firstBlockTime).count() << " us, total "
+              << duration_cast<microseconds>(stats.duration).count() << " us" << std::endl;
+}
 
+void processRRQ(int sockfd, UdpTransport &transport, const char *filename, std::string filePath)
+{
+    SteadyClock clock;
     std::ofstream file;
-    file.open(filePath, std::ios::binary);
-
-    if (!file.good())
-    {
-        std::cerr << "Error writing to the file." << std::endl;
-        return;
-    }
-
-    bool isLastPacket = false;
-    while (!isLastPacket)
-    {
-        // Process DATA packet
-        uint16_t blockNumber = ntohs(receivedPkt.dataPacket.blockNumber);
-        size_t bytesRead = std::min(strlen(receivedPkt.dataPacket.data), static_cast<size_t>(MAX_DATA_LEN));
-
-        // Write the received data to the file
-        if (bytesRead < MAX_DATA_LEN)
-        {
-            isLastPacket = true;
-            file.write(receivedPkt.dataPacket.data, bytesRead);
-        }
-        else
-            file.write(receivedPkt.dataPacket.data, MAX_DATA_LEN);
-
-        std::cout << "Received Block #" << blockNumber << std::endl;
-
-        file.flush();
-
-        // Send ACK packet back to the server
-        sendAckPacket(sockfd, blockNumber, serv_addr, serLen);
-
-        // Receive the next packet from the server if not last packet
-        if (!isLastPacket)
-        {
-            ssize_t receivedBytes = recvfrom(sockfd, &receivedPkt, sizeof(receivedPkt), 0,
-                                             (struct sockaddr *)&serv_addr, &serLen);
-            if (receivedBytes == -1)
-            {
-                perror("Error receiving TFTP data packet");
-                close(sockfd);
-                return;
-            }
-        }
-    }
 
+    // The file is created with the first block, so an error reply leaves nothing behind
+    TftpReceiver<UdpTransport, SteadyClock> receiver(transport, clock, [&file, &filePath](const char *data, size_t length)
+                                                     {
+                                                         if (!file.is_open())
+                                                             file.open(filePath, std::ios::binary);
+                                                         file.write(data, length);
+                                                         return file.good();
+                                                     });
+    receiver.startWithRequest(filename);
+    std::cout << "TFTP request packet sent successfully." << std::endl;
+
+    runTransfer(receiver, transport);
     file.close();
+    std::cout << "Received " << receiver.stats().blocks << " blocks" << std::endl;
+    reportLatency(receiver.stats());
+
+    handleTransferResult(receiver, sockfd);
 }
 
-void processWRQ(int sockfd, struct sockaddr_in serv_addr, std::string filePath)
+void processWRQ(int sockfd, UdpTransport &transport, const char *filename, std::string filePath)
 {
-    TftpPacketUnion receivedPkt;
-    socklen_t serLen = sizeof(serv_addr);
-
-    handleFirstReceivedPacket(sockfd, serv_addr, receivedPkt, serLen);
+    SteadyClock clock;
 
     // Open file for read
-    std::ifstream file(filePath, std::ios::binary);
+    FilePrefetcher file(filePath.c_str());
 
     // Handle file open error
-    if (!file.is_open())
+    if (!file.isOpen())
     {
         std::cerr << "Error opening file for read: " << filePath << std::endl;
         close(sockfd);
         exit(3);
     }
 
-    // Initialize local block number
-    uint16_t clientBlockNumber = 0;
-
-    // Wait for the 1st ACK from the server with the block number that the server successfully received
-    uint16_t receivedBlockNumber = ntohs(receivedPkt.ackPacket.blockNumber);
-
-    // Check if the acknowledgment has the expected block number
-    // If yes, the client knows that the server successfully received the data block
-    // If the acknowledgment has a different block number
-    // the client may need to retransmit the last data block
-    if (receivedBlockNumber != clientBlockNumber)
-        std::cerr << "Unexpected ACK received. Expected: " << clientBlockNumber << ", Received: " << receivedBlockNumber << std::endl;
-
-    std::cout << "Received ACK #" << receivedBlockNumber << std::endl;
-    // Increment local block number for the next data block
-    clientBlockNumber++;
-
-    char buffer[MAX_DATA_LEN];
-    bool isLastPacket = false;
-    while (!isLastPacket)
-    {
-        // Create a data packet
-        TftpDataPacket dataPacket;
-        dataPacket.opcode = htons(TFTP_DATA);
-        dataPacket.blockNumber = htons(clientBlockNumber);
-
-        // Read data from the file into buffer and copy to data packet
-        file.read(buffer, MAX_DATA_LEN);
-        size_t bytesRead = file.gcount();
-
-        if (bytesRead < MAX_DATA_LEN)
-            isLastPacket = true; // EOF reached, break the loop
-
-        if (bytesRead != 0)
-        {
-            for (size_t i = 0; i < bytesRead; i++)
-                dataPacket.data[i] = buffer[i];
-        }
-
-        // dataPacket.data[bytesRead] = '\0';
-        std::cout << bytesRead << dataPacket.data << std::endl;
-
-        // Send data packet to the server
-        sendDataPacket(sockfd, dataPacket, clientBlockNumber, serv_addr, serLen);
-
-        // Wait for ACK from the server with the block number that the server successfully received
-        if (isLastPacket)
-            break;
-
-        TftpAckPacket ackPacket;
-        ssize_t ackBytesReceived = receiveAckPacket(sockfd, ackPacket, serv_addr, serLen);
-        uint16_t receivedBlockNumber = ntohs(ackPacket.blockNumber);
-        std::cout << "Received ACK #" << receivedBlockNumber << std::endl;
+    // Send the WRQ, then each block once the server acknowledges the previous one
+    TftpSender<UdpTransport, SteadyClock> sender(transport, clock, [&file](char *buffer)
+                                                 { return file.nextBlock(buffer); });
+    sender.startWithRequest(filename);
+    std::cout << "TFTP request packet sent successfully." << std::endl;
 
-        // Check if the acknowledgment has the expected block number
-        // If yes, the client knows that the server successfully received the data block
-        // If the acknowledgment has a different block number
-        // the client may need to retransmit the last data block
-        if (receivedBlockNumber != clientBlockNumber)
-        {
-            std::cerr << "Unexpected ACK received. Expected: " << clientBlockNumber << ", Received: " << receivedBlockNumber << std::endl;
-            break;
-        }
-
-        // Increment local block number for the next data block
-        clientBlockNumber++;
-    }
+    runTransfer(sender, transport);
+    std::cout << "Sent " << sender.stats().blocks << " blocks" << std::endl;
+    reportLatency(sender.stats());
 
-    file.close();
+    handleTransferResult(sender, sockfd);
 }
 
 /* The main program sets up the local socket for communication     */
@@ -183,18 +95,17 @@ void processWRQ(int sockfd, struct sockaddr_in serv_addr, std::string filePath)
 int main(int argc, char *argv[])
 {
     program = argv[0];
+    startTracing(1);
 
     int sockfd;
     struct sockaddr_in cli_addr, serv_addr;
     memset(&serv_addr, 0, sizeof(serv_addr));
     memset(&cli_addr, 0, sizeof(cli_addr));
 
-    socklen_t serLen = sizeof(serv_addr);
-
     // Initialize server and client address structure
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = inet_addr(SERV_HOST_ADDR);
-    serv_addr.sin_port = htons(SERV_UDP_PORT);
+    serv_addr.sin_port = htons(resolvePort("TFTP_SERVER_PORT", SERV_UDP_PORT));
 
     cli_addr.sin_family = AF_INET;
     cli_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -207,6 +118,7 @@ int main(int argc, char *argv[])
         perror("socket creation failed.");
         exit(1);
     }
+    tuneSocketForLatency(sockfd);
 
     // Bind the socket
     if (bind(sockfd, (struct sockaddr *)&cli_addr, sizeof(cli_addr)) < 0)
@@ -235,12 +147,12 @@ int main(int argc, char *argv[])
 
     std::string filePath = std::string(CLIENT_FOLDER) + std::string(filename);
 
-    // Handle read or write request
+    // Handle read or write request, following the server to the port it answers from
     std::cout << "Processing TFTP request..." << std::endl;
+    UdpTransport transport(sockfd, serv_addr, true);
     if (requestType == 'r')
     {
-        handleRequestPacket(filename, TFTP_RRQ, sockfd, serv_addr);
-        processRRQ(sockfd, serv_addr, filePath);
+        processRRQ(sockfd, transport, filename, filePath);
     }
     else if (requestType == 'w')
     {
@@ -250,8 +162,7 @@ int main(int argc, char *argv[])
             exit(0);
         }
 
-        handleRequestPacket(filename, TFTP_WRQ, sockfd, serv_addr);
-        processWRQ(sockfd, serv_addr, filePath);
+        processWRQ(sockfd, transport, filename, filePath);
     }
 
     std::cout << "Process finished with exit code 0" << std::endl;
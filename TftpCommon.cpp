@@ -2,9 +2,17 @@
 // Created by B Pan on 1/15/24.
 //
 
-#include <csignal>
+#include <algorithm>
 #include <chrono>
 #include <thread>
+#include <cerrno>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <ctime>
 #include "TftpCommon.h"
 
 // Helper function to print the first len bytes of the buffer in Hex
@@ -17,28 +25,6 @@ static void printBuffer(const char *buffer, unsigned int len)
     printf("\n");
 }
 
-// Increment retry count when timeout occurs
-void handleTimeout(int signum)
-{
-    retryCount++;
-    printf("timeout occurred! count %d\n", retryCount);
-}
-
-int registerTimeoutHandler()
-{
-    signal(SIGALRM, handleTimeout);
-
-    /* disable the restart of system call on signal. otherwise the OS will be stuck in
-     * the system call
-     */
-    if (siginterrupt(SIGALRM, 1) == -1)
-    {
-        printf("invalid sig number.\n");
-        return -1;
-    }
-    return 0;
-}
-
 /*
  * Useful things:
  * alarm(1) // set timer for 1 sec
@@ -51,92 +37,665 @@ int registerTimeoutHandler()
  * sending bytes, receiving bytes, parse opcode from a tftp packet, parse data block/ack number from a tftp packet,
  * create a data block/ack packet, and the common "process the file transfer" logic.
  */
-void handleRequestPacket(char *filename, int opcode, int sockfd, struct sockaddr_in serv_addr)
+size_t buildRequestPacket(TftpPacketUnion &packet, int opcode, const char *filename)
+{
+    // opcode | filename | 0 | mode | 0
+    char *ptr = reinterpret_cast<char *>(&packet);
+    size_t nameLength = strnlen(filename, sizeof(packet.requestPacket.filename) - 1);
+
+    packet.requestPacket.opcode = htons(opcode);
+    memcpy(ptr + 2, filename, nameLength);
+    ptr[2 + nameLength] = '\0';
+    memcpy(ptr + 3 + nameLength, "octet", 6);
+    return 2 + nameLength + 1 + 6;
+}
+
+size_t buildErrorPacket(TftpPacketUnion &packet, int errorCode, const std::string &errorMsg)
 {
-    // Create a TFTP request packet
-    TftpRequestPacket requestPkt;
-    requestPkt.opcode = htons(opcode); // set opcode to RRQ or WRQ
-    strcpy(requestPkt.filename, filename);
+    TftpErrorPacket &errorPacket = packet.errorPacket;
+    size_t messageLength = std::min(errorMsg.size(), sizeof(errorPacket.errorMessage) - 1);
+
+    errorPacket.opcode = htons(TFTP_ERROR);
+    errorPacket.errorCode = htons(errorCode);
+    memcpy(errorPacket.errorMessage, errorMsg.data(), messageLength);
+    errorPacket.errorMessage[messageLength] = '\0';
+    return 4 + messageLength + 1;
+}
 
-    // Send the packet to the server
-    ssize_t sentBytes = sendto(sockfd, &requestPkt, sizeof(requestPkt), 0,
-                               (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+uint16_t resolvePort(const char *envName, uint16_t defaultPort)
+{
+    const char *value = getenv(envName);
+    if (value == nullptr)
+        return defaultPort;
 
-    if (sentBytes == -1)
+    char *end;
+    long port = strtol(value, &end, 10);
+    if (*end != '\0' || port <= 0 || port > 65535)
     {
-        perror("Error sending TFTP request packet");
-        return;
+        std::cerr << "Ignoring invalid " << envName << "=" << value << std::endl;
+        return defaultPort;
     }
+    return static_cast<uint16_t>(port);
+}
 
-    std::cout << "TFTP request packet sent successfully." << std::endl;
+long resolveNumber(const char *envName, long defaultValue)
+{
+    const char *value = getenv(envName);
+    if (value == nullptr)
+        return defaultValue;
+
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (*end != '\0' || number < 0)
+    {
+        std::cerr << "Ignoring invalid " << envName << "=" << value << std::endl;
+        return defaultValue;
+    }
+    return number;
+}
+
+bool isPlainFilename(const char *name)
+{
+    return name[0] != '\0' && strchr(name, '/') == nullptr && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
 }
 
-void sendDataPacket(int sockfd, TftpDataPacket &dataPacket, uint16_t blockNumber, struct sockaddr_in &dest_addr, socklen_t _len)
+bool handleErrorPacket(int errorCode, std::string errorMsg, int sockfd, struct sockaddr_in _addr, socklen_t _len)
 {
-    // Set the block number in the data packet
-    dataPacket.blockNumber = htons(blockNumber);
+    // Construct an error packet
+    TftpPacketUnion errorPacket;
+    size_t length = buildErrorPacket(errorPacket, errorCode, errorMsg);
 
-    // Send the Data Packet to the client
-    ssize_t bytesSent = sendto(sockfd, &dataPacket, sizeof(TftpDataPacket), 0, (struct sockaddr *)&dest_addr, _len);
+    // Send the error packet to the client
+    if (traceEnabled())
+        tracePacket(TRACE_SENT, localAddressOf(sockfd), _addr, &errorPacket, length);
+    ssize_t bytesSent = sendto(sockfd, &errorPacket, length, 0, (struct sockaddr *)&_addr, _len);
     if (bytesSent < 0)
     {
         perror("sendto error");
-        exit(4);
+        return false;
     }
+    return true;
 }
 
-ssize_t receiveDataPacket(int sockfd, TftpDataPacket &dataPacket, struct sockaddr_in &source_addr, socklen_t &_len)
+namespace
 {
-    // Wait for data packets from the sender
-    ssize_t bytesReceived = recvfrom(sockfd, &dataPacket, sizeof(TftpDataPacket), 0, (struct sockaddr *)&source_addr, &_len);
-    if (bytesReceived < 0)
+    // One memory-mapped trace file. A ring is written by one thread at a time.
+    struct TraceRing
     {
-        perror("recvfrom error");
-        exit(5);
+        TraceFileHeader *header = nullptr;
+        TraceRecord *records = nullptr;
+
+        bool open(uint32_t ringIndex)
+        {
+            std::string folder = getenv("TFTP_TRACE_DIR");
+            if (!folder.empty() && folder.back() != '/')
+                folder += '/';
+            mkdir(folder.c_str(), 0755);
+
+            std::string path = folder + "trace-" + std::to_string(getpid()) + "-" + std::to_string(ringIndex) + ".bin";
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                perror("Unable to create trace file");
+                return false;
+            }
+
+            // Fault every page in now rather than on the packet path
+            size_t mappedSize = sizeof(TraceFileHeader) + sizeof(TraceRecord) * TRACE_RING_RECORDS;
+            void *mapped = MAP_FAILED;
+            if (ftruncate(fd, mappedSize) == 0)
+                mapped = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED)
+            {
+                perror("Unable to map trace file");
+                return false;
+            }
+
+            struct timespec realtime, monotonic;
+            clock_gettime(CLOCK_REALTIME, &realtime);
+            clock_gettime(CLOCK_MONOTONIC, &monotonic);
+
+            header = static_cast<TraceFileHeader *>(mapped);
+            records = reinterpret_cast<TraceRecord *>(header + 1);
+            memcpy(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+            header->version = 1;
+            header->recordSize = sizeof(TraceRecord);
+            header->capacity = TRACE_RING_RECORDS;
+            header->next = 0;
+            header->realtimeOffsetNs = (realtime.tv_sec - monotonic.tv_sec) * 1000000000LL + (realtime.tv_nsec - monotonic.tv_nsec);
+            header->pid = getpid();
+            header->ringIndex = ringIndex;
+            return true;
+        }
+    };
+
+    // Rings not held by any thread. Threads borrow one on their first packet and give it back when they
+    // exit, so short-lived threads reuse rings instead of creating a file each. Never freed, because
+    // detached threads may still return rings while the process exits.
+    struct TracePool
+    {
+        std::mutex lock;
+        std::vector<TraceRing *> idle;
+        uint32_t created = 0;
+        bool failed = false;
+
+        // Create a ring and add it to the idle list
+        bool grow()
+        {
+            TraceRing *ring = new TraceRing();
+            if (!ring->open(created))
+            {
+                delete ring;
+                failed = true;
+                return false;
+            }
+            created++;
+            idle.push_back(ring);
+            return true;
+        }
+    };
+
+    TracePool &tracePool()
+    {
+        static TracePool *pool = new TracePool();
+        return *pool;
     }
 
-    return bytesReceived;
+    // The ring the calling thread writes to, returned to the pool when the thread exits
+    struct TraceSlot
+    {
+        TraceRing *ring = nullptr;
+
+        ~TraceSlot()
+        {
+            if (ring == nullptr)
+                return;
+            TracePool &pool = tracePool();
+            std::lock_guard<std::mutex> guard(pool.lock);
+            pool.idle.push_back(ring);
+        }
+    };
+
+    thread_local TraceSlot traceSlot;
 }
 
-void sendAckPacket(int sockfd, uint16_t blockNumber, struct sockaddr_in &dest_addr, socklen_t _len)
+bool traceEnabled()
 {
-    // Create an ACK packet
-    TftpAckPacket ackPacket;
-    ackPacket.blockNumber = htons(blockNumber);
+    static const bool enabled = getenv("TFTP_TRACE_DIR") != nullptr;
+    return enabled;
+}
 
-    // Send the ACK packet to the receiver
-    ssize_t bytesSent = sendto(sockfd, &ackPacket, sizeof(TftpAckPacket), 0, (struct sockaddr *)&dest_addr, _len);
-    if (bytesSent < 0)
+void startTracing(unsigned int rings)
+{
+    if (!traceEnabled())
+        return;
+
+    TracePool &pool = tracePool();
+    std::lock_guard<std::mutex> guard(pool.lock);
+    while (pool.created < rings && pool.grow())
     {
-        perror("sendto error");
-        exit(4);
     }
 }
 
-ssize_t receiveAckPacket(int sockfd, TftpAckPacket &ackPacket, struct sockaddr_in &source_addr, socklen_t &_len)
+void tracePacket(TraceDirection direction, const struct sockaddr_in &local_addr, const struct sockaddr_in &peer_addr,
+                 const void *packet, size_t length)
 {
-    // Wait for acknowledgment (ACK) from the sender
-    ssize_t bytesReceived = recvfrom(sockfd, &ackPacket, sizeof(TftpAckPacket), 0, (struct sockaddr *)&source_addr, &_len);
-    if (bytesReceived < 0)
+    if (!traceEnabled())
+        return;
+
+    if (traceSlot.ring == nullptr)
     {
-        perror("recvfrom error");
-        exit(5);
+        // Only more concurrent threads than ever before make a new ring on the packet path
+        TracePool &pool = tracePool();
+        std::lock_guard<std::mutex> guard(pool.lock);
+        if (pool.idle.empty() && (pool.failed || !pool.grow()))
+            return;
+        traceSlot.ring = pool.idle.back();
+        pool.idle.pop_back();
     }
-    return bytesReceived;
+    TraceRing &ring = *traceSlot.ring;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    const unsigned char *bytes = static_cast<const unsigned char *>(packet);
+    uint64_t index = ring.header->next;
+    TraceRecord &record = ring.records[index % TRACE_RING_RECORDS];
+    record.timestampNs = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record.localAddr = local_addr.sin_addr.s_addr;
+    record.peerAddr = peer_addr.sin_addr.s_addr;
+    record.localPort = local_addr.sin_port;
+    record.peerPort = peer_addr.sin_port;
+    record.direction = direction;
+    record.reserved = 0;
+    record.opcode = length >= 2 ? (bytes[0] << 8 | bytes[1]) : 0;
+    record.blockNumber = length >= 4 ? (bytes[2] << 8 | bytes[3]) : 0;
+    record.length = length;
+    record.reserved2 = 0;
+
+    // Publish the record to readers of a live file
+    __atomic_store_n(&ring.header->next, index + 1, __ATOMIC_RELEASE);
 }
 
-void handleErrorPacket(int errorCode, std::string errorMsg, int sockfd, struct sockaddr_in _addr, socklen_t _len)
+struct sockaddr_in localAddressOf(int sockfd)
 {
-    // Construct an error packet
-    TftpErrorPacket errorPacket;
-    errorPacket.errorCode = htons(errorCode);
-    errorPacket.errorMessage = errorMsg;
+    struct sockaddr_in local_addr;
+    socklen_t localLen = sizeof(local_addr);
+    memset(&local_addr, 0, sizeof(local_addr));
+    if (getsockname(sockfd, (struct sockaddr *)&local_addr, &localLen) != 0)
+        memset(&local_addr, 0, sizeof(local_addr));
+    return local_addr;
+}
 
-    // Send the error packet to the client
-    ssize_t bytesSent = sendto(sockfd, &errorPacket, sizeof(TftpErrorPacket), 0, (struct sockaddr *)&_addr, _len);
+const LatencyOptions &latencyOptions()
+{
+    static const LatencyOptions options = []
+    {
+        LatencyOptions options;
+        options.enabled = getenv("TFTP_LOW_LATENCY") != nullptr;
+        if (options.enabled)
+        {
+            options.spinTime = std::chrono::microseconds(resolveNumber("TFTP_SPIN_US", LOW_LATENCY_SPIN_US));
+            options.socketBuffer = resolveNumber("TFTP_SOCKET_BUFFER", LOW_LATENCY_SOCKET_BUFFER);
+        }
+        return options;
+    }();
+    return options;
+}
+
+void tuneSocketForLatency(int sockfd)
+{
+    const LatencyOptions &options = latencyOptions();
+    if (!options.enabled)
+        return;
+
+    // Let the kernel poll the device queue for as long as we spin. Raising it above the
+    // net.core.busy_poll sysctl needs CAP_NET_ADMIN, so a failure only costs the optimization.
+    int busyPoll = options.spinTime.count();
+    if (busyPoll > 0 && setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(busyPoll)) != 0)
+        perror("Unable to set SO_BUSY_POLL");
+
+    if (options.socketBuffer > 0)
+    {
+        if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &options.socketBuffer, sizeof(options.socketBuffer)) != 0)
+            perror("Unable to set SO_RCVBUF");
+        if (setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &options.socketBuffer, sizeof(options.socketBuffer)) != 0)
+            perror("Unable to set SO_SNDBUF");
+    }
+}
+
+ssize_t receiveFrom(int sockfd, void *buffer, size_t length, struct sockaddr_in &source_addr, socklen_t &sourceLen)
+{
+    const LatencyOptions &options = latencyOptions();
+    socklen_t addrLen = sourceLen;
+    if (options.spinTime.count() > 0)
+    {
+        auto spinUntil = std::chrono::steady_clock::now() + options.spinTime;
+        do
+        {
+            sourceLen = addrLen;
+            ssize_t bytesReceived = recvfrom(sockfd, buffer, length, MSG_DONTWAIT, (struct sockaddr *)&source_addr, &sourceLen);
+            if (bytesReceived >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                return bytesReceived;
+        } while (std::chrono::steady_clock::now() < spinUntil);
+    }
+
+    sourceLen = addrLen;
+    return recvfrom(sockfd, buffer, length, 0, (struct sockaddr *)&source_addr, &sourceLen);
+}
+
+UdpTransport::UdpTransport(int sockfd, const struct sockaddr_in &peer_addr, bool latchPeer)
+    : sockfd(sockfd), peer_addr(peer_addr), latchPeer(latchPeer)
+{
+    memset(&local_addr, 0, sizeof(local_addr));
+    if (traceEnabled())
+        local_addr = localAddressOf(sockfd);
+}
+
+bool UdpTransport::send(const void *packet, size_t length)
+{
+    tracePacket(TRACE_SENT, local_addr, peer_addr, packet, length);
+    ssize_t bytesSent = sendto(sockfd, packet, length, 0, (struct sockaddr *)&peer_addr, sizeof(peer_addr));
     if (bytesSent < 0)
     {
         perror("sendto error");
-        exit(4);
+        return false;
+    }
+    return true;
+}
+
+ssize_t UdpTransport::receive(TftpPacketUnion &packet, std::chrono::steady_clock::time_point deadline)
+{
+    // In low-latency mode, catch a reply that arrives within the spin time without going to sleep
+    std::chrono::microseconds spinTime = latencyOptions().spinTime;
+    if (spinTime.count() > 0)
+    {
+        auto spinUntil = std::min(deadline, std::chrono::steady_clock::now() + spinTime);
+        do
+        {
+            ssize_t bytesReceived = tryReceive(packet);
+            if (bytesReceived != TRANSPORT_WOULD_BLOCK)
+                return bytesReceived;
+        } while (std::chrono::steady_clock::now() < spinUntil);
+    }
+
+    for (;;)
+    {
+        // Wait for the socket to become readable, rounding the remaining time up to whole milliseconds
+        int timeoutMs = -1;
+        if (deadline != std::chrono::steady_clock::time_point::max())
+        {
+            auto remaining = deadline - std::chrono::steady_clock::now();
+            if (remaining <= std::chrono::steady_clock::duration::zero())
+                return TRANSPORT_TIMEOUT;
+            timeoutMs = std::chrono::ceil<std::chrono::milliseconds>(remaining).count();
+        }
+
+        struct pollfd readable = {sockfd, POLLIN, 0};
+        int ready = poll(&readable, 1, timeoutMs);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
+        {
+            perror("poll error");
+            return -1;
+        }
+        if (ready == 0)
+            return TRANSPORT_TIMEOUT;
+
+        ssize_t bytesReceived = tryReceive(packet);
+        if (bytesReceived == TRANSPORT_WOULD_BLOCK)
+            continue;
+        return bytesReceived;
+    }
+}
+
+ssize_t UdpTransport::tryReceive(TftpPacketUnion &packet)
+{
+    for (;;)
+    {
+        struct sockaddr_in source_addr;
+        socklen_t sourceLen = sizeof(source_addr);
+        ssize_t bytesReceived = recvfrom(sockfd, &packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr *)&source_addr, &sourceLen);
+        if (bytesReceived < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return TRANSPORT_WOULD_BLOCK;
+            perror("recvfrom error");
+            return -1;
+        }
+        tracePacket(TRACE_RECEIVED, local_addr, source_addr, &packet, bytesReceived);
+
+        if (latchPeer)
+        {
+            peer_addr = source_addr;
+            latchPeer = false;
+        }
+        else if (source_addr.sin_addr.s_addr != peer_addr.sin_addr.s_addr || source_addr.sin_port != peer_addr.sin_port)
+        {
+            // Another client is trying to start a transfer; it will retransmit once this one is done
+            continue;
+        }
+        return bytesReceived;
+    }
+}
+
+FilePrefetcher::FilePrefetcher(const char *filePath)
+{
+    fd = open(filePath, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    // Tell the kernel the whole file is about to be read front to back
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+    worker = std::thread(&FilePrefetcher::readAhead, this);
+}
+
+FilePrefetcher::~FilePrefetcher()
+{
+    if (worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        slotFree.notify_one();
+        worker.join();
     }
-}
\ No newline at end of file
+
+    if (fd >= 0)
+        close(fd);
+}
+
+void FilePrefetcher::readAhead()
+{
+    for (;;)
+    {
+        size_t slot;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            slotFree.wait(guard, [this]
+                          { return stopping || produced - consumed < PREFETCH_BLOCKS; });
+            if (stopping)
+                return;
+            slot = produced % PREFETCH_BLOCKS;
+        }
+
+        // Fill the slot outside the lock; read may return less than asked before EOF
+        ssize_t length = 0;
+        while (length < MAX_DATA_LEN)
+        {
+            ssize_t bytesRead = read(fd, ring[slot] + length, MAX_DATA_LEN - length);
+            if (bytesRead < 0 && errno == EINTR)
+                continue;
+            if (bytesRead < 0)
+            {
+                perror("Error reading file");
+                length = -1;
+                break;
+            }
+            if (bytesRead == 0)
+                break;
+            length += bytesRead;
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        lengths[slot] = length;
+        produced++;
+        blockReady.notify_one();
+
+        // A short block (or error) is the last one of the file
+        if (length < MAX_DATA_LEN)
+        {
+            finished = true;
+            return;
+        }
+    }
+}
+
+ssize_t FilePrefetcher::nextBlock(char *buffer)
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    if (produced == consumed)
+    {
+        if (finished)
+            return 0;
+
+        auto start = std::chrono::steady_clock::now();
+        blockReady.wait(guard, [this]
+                        { return produced != consumed; });
+        stalls++;
+        stalledFor += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    }
+
+    size_t slot = consumed % PREFETCH_BLOCKS;
+    ssize_t length = lengths[slot];
+    if (length > 0)
+        memcpy(buffer, ring[slot], length);
+    consumed++;
+
+    guard.unlock();
+    slotFree.notify_one();
+    return length;
+}
+
+FileIndex::FileIndex(const std::string &folder) : folder(folder)
+{
+    inotifyFd = inotify_init1(IN_CLOEXEC);
+    if (inotifyFd < 0 || pipe(stopPipe) != 0 || !addWatch())
+    {
+        // Without inotify the index cannot be trusted, so lookup falls back to stat
+        perror("Unable to watch folder, file index disabled");
+        if (inotifyFd >= 0)
+            close(inotifyFd);
+        inotifyFd = -1;
+        return;
+    }
+
+    // Watch before scanning so no change between the two is missed
+    scan();
+
+    watcher = std::thread(&FileIndex::watch, this);
+}
+
+FileIndex::~FileIndex()
+{
+    if (watcher.joinable())
+    {
+        char stop = 0;
+        ssize_t written = write(stopPipe[1], &stop, 1);
+        (void)written;
+        watcher.join();
+    }
+
+    for (int fd : {inotifyFd.load(), stopPipe[0], stopPipe[1]})
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+}
+
+bool FileIndex::lookup(const std::string &filename, FileInfo &info) const
+{
+    if (inotifyFd < 0)
+    {
+        struct stat st;
+        if (stat((folder + filename).c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            return false;
+        info.size = st.st_size;
+        info.mtime = st.st_mtim;
+        return true;
+    }
+
+    std::shared_lock<std::shared_mutex> guard(lock);
+    auto it = files.find(filename);
+    if (it == files.end())
+        return false;
+    info = it->second;
+    return true;
+}
+
+void FileIndex::update(const std::string &filename)
+{
+    struct stat st;
+    bool exists = stat((folder + filename).c_str(), &st) == 0 && S_ISREG(st.st_mode);
+
+    std::unique_lock<std::shared_mutex> guard(lock);
+    if (exists)
+        files[filename] = FileInfo{st.st_size, st.st_mtim};
+    else
+        files.erase(filename);
+}
+
+// Watch whatever is at the folder path now, dropping the watch on the folder that used to be there
+bool FileIndex::addWatch()
+{
+    if (watchDescriptor >= 0)
+        inotify_rm_watch(inotifyFd, watchDescriptor);
+    watchDescriptor = inotify_add_watch(inotifyFd, folder.c_str(), IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE |
+                                                                       IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    return watchDescriptor >= 0;
+}
+
+void FileIndex::scan()
+{
+    std::unordered_map<std::string, FileInfo> found;
+
+    DIR *dir = opendir(folder.c_str());
+    if (dir != nullptr)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            struct stat st;
+            if (stat((folder + entry->d_name).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                found[entry->d_name] = FileInfo{st.st_size, st.st_mtim};
+        }
+        closedir(dir);
+    }
+
+    std::unique_lock<std::shared_mutex> guard(lock);
+    files.swap(found);
+    std::cout << "Indexed " << files.size() << " files in " << folder << std::endl;
+}
+
+void FileIndex::watch()
+{
+    alignas(struct inotify_event) char events[4096];
+    struct pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {stopPipe[0], POLLIN, 0}};
+
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll failed, file index stopped");
+            return;
+        }
+        if (fds[1].revents != 0)
+            return;
+
+        ssize_t length = read(inotifyFd, events, sizeof(events));
+        if (length <= 0)
+            continue;
+
+        for (char *ptr = events; ptr < events + length;)
+        {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            // Lost events: rebuild from scratch
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                scan();
+                continue;
+            }
+            // Left over from a folder that is no longer watched
+            if (event->wd != watchDescriptor)
+                continue;
+
+            // The folder was deleted or moved away and the watch went with it, so watch the path again.
+            // If nothing is there yet the index cannot be kept current, so lookup falls back to stat.
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+            {
+                if (!addWatch())
+                {
+                    perror("Unable to watch replaced folder, file index disabled");
+                    int fd = inotifyFd.exchange(-1);
+                    close(fd);
+                    return;
+                }
+                scan();
+            }
+            else if (event->len > 0 && !(event->mask & IN_ISDIR))
+                update(event->name);
+        }
+    }
+}
@@ -12,23 +12,22 @@
 #include <unistd.h>
 #include <netinet/in.h>
 #include <thread>
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <unordered_map>
+#include <sys/stat.h>
 #include "fstream"
 #include "TftpError.h"
 #include "TftpOpcode.h"
 #include "TftpConstant.h"
 
-// To track how retransmit/retry has occurred.
-static int retryCount = 0;
-static bool timeoutOccurred = false;
-
 // Helper function to print the first len bytes of the buffer in Hex
 static void printBuffer(const char *buffer, unsigned int len);
 
-// Increment retry count when timeout occurs.
-void handleTimeout(int signum);
-int registerTimeoutHandler();
-
 // Structure representing the TFTP request packet
 struct TftpRequestPacket
 {
@@ -39,7 +38,11 @@ struct TftpRequestPacket
     TftpRequestPacket() : mode("octet") {}
 };
 
-void handleRequestPacket(char *filename, int opcode, int sockfd, struct sockaddr_in serv_addr);
+// Read the UDP port from the given environment variable, falling back to defaultPort when unset or invalid
+uint16_t resolvePort(const char *envName, uint16_t defaultPort);
+
+// Read a non-negative number from the given environment variable, falling back to defaultValue when unset or invalid
+long resolveNumber(const char *envName, long defaultValue);
 
 // Structure representing the TFTP data packet
 struct TftpDataPacket
@@ -51,9 +54,6 @@ struct TftpDataPacket
     TftpDataPacket() : opcode(htons(TFTP_DATA)) {}
 };
 
-void sendDataPacket(int sockfd, TftpDataPacket &dataPacket, uint16_t blockNumber, struct sockaddr_in &dest_addr, socklen_t _len);
-ssize_t receiveDataPacket(int sockfd, TftpDataPacket &dataPacket, struct sockaddr_in &source_addr, socklen_t &_len);
-
 // Structure representing the TFTP acknowledgment packet
 struct TftpAckPacket
 {
@@ -63,20 +63,21 @@ struct TftpAckPacket
     TftpAckPacket() : opcode(htons(TFTP_ACK)) {}
 };
 
-void sendAckPacket(int sockfd, uint16_t blockNumber, struct sockaddr_in &dest_addr, socklen_t _len);
-ssize_t receiveAckPacket(int sockfd, TftpAckPacket &ackPacket, struct sockaddr_in &source_addr, socklen_t &_len);
-
 // Structure representing the TFTP error packet
 struct TftpErrorPacket
 {
     uint16_t opcode;
     uint16_t errorCode;
-    std::string errorMessage;
+    char errorMessage[512] = {}; // null-terminated on the wire
 
-    TftpErrorPacket() : opcode(htons(TFTP_ERROR)), errorMessage("") {}
+    TftpErrorPacket() : opcode(htons(TFTP_ERROR)) {}
 };
 
-void handleErrorPacket(int errorCode, std::string errorMsg, int sockfd, struct sockaddr_in _addr, socklen_t _len);
+// True if name can only refer to a file directly inside the served folder: not empty, no '/', not "." or ".."
+bool isPlainFilename(const char *name);
+
+// Send an ERROR packet. Returns false if it could not be sent.
+bool handleErrorPacket(int errorCode, std::string errorMsg, int sockfd, struct sockaddr_in _addr, socklen_t _len);
 
 // Structure representing the general TFTP packet
 struct TftpPacket
@@ -96,4 +97,191 @@ union TftpPacketUnion
     TftpPacketUnion() { new (&packet) TftpPacket(); }
     ~TftpPacketUnion() { packet.~TftpPacket(); }
 };
+
+// Fill packet with an RRQ or WRQ for filename in octet mode. Returns the packet length.
+size_t buildRequestPacket(TftpPacketUnion &packet, int opcode, const char *filename);
+
+// Fill packet with an ERROR carrying errorCode and errorMsg. Returns the packet length.
+size_t buildErrorPacket(TftpPacketUnion &packet, int errorCode, const std::string &errorMsg);
+
+// Binary packet trace, enabled by setting TFTP_TRACE_DIR. Threads write fixed-size records into memory-mapped
+// ring files in that folder, trace-<pid>-<ring>.bin, overwriting the oldest once TRACE_RING_RECORDS is reached.
+// A thread borrows a ring from a pool on its first packet and returns it when it exits, so in the proxy, where
+// every session and upstream fetch is its own thread, a ring holds the latest packets of whichever sessions
+// used it. tftp-trace turns the files into per-session timelines or a pcap.
+enum TraceDirection : uint8_t
+{
+    TRACE_SENT = 0,
+    TRACE_RECEIVED = 1
+};
+
+// One traced packet. Addresses and ports are in network byte order, everything else in host order.
+// A session is identified by the local and peer address/port pair.
+struct TraceRecord
+{
+    uint64_t timestampNs; // CLOCK_MONOTONIC
+    uint32_t localAddr;
+    uint32_t peerAddr;
+    uint16_t localPort;
+    uint16_t peerPort;
+    uint8_t direction;
+    uint8_t reserved;
+    uint16_t opcode;
+    uint16_t blockNumber; // block for DATA/ACK, error code for ERROR
+    uint16_t length;      // whole TFTP packet
+    uint32_t reserved2;
+};
+
+struct TraceFileHeader
+{
+    char magic[8];            // TRACE_MAGIC
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t capacity;        // records in the ring
+    uint64_t next;            // records written so far; the ring holds the last min(next, capacity)
+    int64_t realtimeOffsetNs; // CLOCK_REALTIME - CLOCK_MONOTONIC when the file was created
+    uint32_t pid;
+    uint32_t ringIndex;
+    char reserved[16];
+};
+
+static const char TRACE_MAGIC[8] = {'T', 'F', 'T', 'P', 'T', 'R', 'C', '1'};
+
+static_assert(sizeof(TraceRecord) == 32, "trace records are read back by tftp-trace");
+static_assert(sizeof(TraceFileHeader) == 64, "trace records start at a fixed offset");
+
+// True when TFTP_TRACE_DIR is set
+bool traceEnabled();
+
+// Create rings up front, one per thread expected to trace at once, so the first transfers do not pay for
+// making trace files. Called from main(); does nothing unless traceEnabled().
+void startTracing(unsigned int rings);
+
+// Append a packet to the calling thread's ring. Does nothing unless traceEnabled().
+void tracePacket(TraceDirection direction, const struct sockaddr_in &local_addr, const struct sockaddr_in &peer_addr,
+                 const void *packet, size_t length);
+
+// Local address of a socket for tracePacket, all zeros if unknown
+struct sockaddr_in localAddressOf(int sockfd);
+
+// Opt-in low-latency mode, enabled by setting TFTP_LOW_LATENCY. A receive first spins on the non-blocking
+// socket for spinTime and only then sleeps, and sockets get SO_BUSY_POLL and larger buffers, trading CPU
+// for wakeup latency on small transfers.
+struct LatencyOptions
+{
+    bool enabled = false;
+    std::chrono::microseconds spinTime{0}; // TFTP_SPIN_US, default LOW_LATENCY_SPIN_US
+    int socketBuffer = 0;                  // TFTP_SOCKET_BUFFER bytes, default LOW_LATENCY_SOCKET_BUFFER
+};
+
+// Options read from the environment on first use
+const LatencyOptions &latencyOptions();
+
+// Apply SO_BUSY_POLL and the SO_RCVBUF/SO_SNDBUF sizes to a socket. Does nothing unless low-latency mode is on.
+void tuneSocketForLatency(int sockfd);
+
+// recvfrom() that spins with MSG_DONTWAIT for the configured time in low-latency mode before blocking
+ssize_t receiveFrom(int sockfd, void *buffer, size_t length, struct sockaddr_in &source_addr, socklen_t &sourceLen);
+
+// Returned by a transport's receive when the deadline passed without a packet
+static const ssize_t TRANSPORT_TIMEOUT = -2;
+// Returned by UdpTransport::tryReceive when no packet is queued
+static const ssize_t TRANSPORT_WOULD_BLOCK = -3;
+
+// Transport that exchanges packets with one peer over a UDP socket. Packets from any other address are
+// dropped. With latchPeer set the peer's address is taken from its first reply, which is how a client
+// learns the TID the server answers from.
+class UdpTransport
+{
+public:
+    UdpTransport(int sockfd, const struct sockaddr_in &peer_addr, bool latchPeer);
+
+    bool send(const void *packet, size_t length);
+
+    // Wait for a packet until deadline. Returns its length, TRANSPORT_TIMEOUT, or -1 on a socket error.
+    ssize_t receive(TftpPacketUnion &packet, std::chrono::steady_clock::time_point deadline);
+
+    // Take a packet that has already arrived. Returns its length, TRANSPORT_WOULD_BLOCK, or -1 on a socket error.
+    ssize_t tryReceive(TftpPacketUnion &packet);
+
+    const struct sockaddr_in &peerAddress() const { return peer_addr; }
+
+private:
+    int sockfd;
+    struct sockaddr_in peer_addr;
+    struct sockaddr_in local_addr; // only looked up when tracing
+    bool latchPeer;
+};
+
+// Reads a file ahead of the sender on a helper thread, so the network loop only copies blocks that are
+// already resident instead of paying for a cold disk read between a DATA packet and its ACK.
+class FilePrefetcher
+{
+public:
+    explicit FilePrefetcher(const char *filePath);
+    ~FilePrefetcher();
+
+    bool isOpen() const { return fd >= 0; }
+
+    // Copy the next block into buffer, waiting for the helper thread if it is not resident yet.
+    // Returns the block length (less than MAX_DATA_LEN for the last block), or -1 on a read error.
+    ssize_t nextBlock(char *buffer);
+
+    // Times the network loop found the ring empty, and how long it waited in total
+    unsigned int stallCount() const { return stalls; }
+    std::chrono::microseconds stallTime() const { return stalledFor; }
+
+private:
+    void readAhead();
+
+    int fd;
+    char ring[PREFETCH_BLOCKS][MAX_DATA_LEN];
+    ssize_t lengths[PREFETCH_BLOCKS];
+    size_t produced = 0; // blocks read by the helper thread
+    size_t consumed = 0; // blocks taken by the network loop
+    bool finished = false; // helper thread has queued the last block
+    bool stopping = false;
+    unsigned int stalls = 0;
+    std::chrono::microseconds stalledFor{0};
+    std::mutex lock;
+    std::condition_variable blockReady;
+    std::condition_variable slotFree;
+    std::thread worker;
+};
+
+// Size and modification time of an indexed file
+struct FileInfo
+{
+    off_t size;
+    struct timespec mtime;
+};
+
+// In-memory index of the regular files in a folder, built at startup and kept current by inotify on a
+// watcher thread, so existence, size and mtime checks cost no filesystem syscalls on the request path.
+class FileIndex
+{
+public:
+    explicit FileIndex(const std::string &folder);
+    ~FileIndex();
+
+    // Returns false when filename is not a regular file in the folder
+    bool lookup(const std::string &filename, FileInfo &info) const;
+
+    // Re-stat filename and record or drop it, for changes the caller made itself
+    void update(const std::string &filename);
+
+private:
+    bool addWatch();
+    void scan();
+    void watch();
+
+    std::string folder;
+    std::atomic<int> inotifyFd{-1}; // -1 when the index is not kept current and lookup uses stat
+    int watchDescriptor = -1;
+    int stopPipe[2] = {-1, -1};
+    std::unordered_map<std::string, FileInfo> files;
+    mutable std::shared_mutex lock;
+    std::thread watcher;
+};
+
 #endif
\ No newline at end of file
@@ -5,5 +5,16 @@ static const unsigned int MAX_PACKET_LEN = 516; // data 512 + opcode 2 + block n
 static const unsigned int MAX_DATA_LEN = 512;
 static const int TIME_OUT = 1;
 static const int MAX_RETRY_COUNT = 10;
+static const int DALLY_TIME_MS = 1500; // a receiver lingers after its last ACK, a little over TIME_OUT
+static const unsigned int PREFETCH_BLOCKS = 64; // data blocks the RRQ sender reads ahead of the network
+static const unsigned int TRACE_RING_RECORDS = 1 << 18; // packets kept in one trace file (8 MB)
+static const unsigned int TRACE_PREOPENED_RINGS = 4; // trace files the proxy creates at startup
+static const unsigned int LOW_LATENCY_SPIN_US = 50; // busy-poll time before sleeping in low-latency mode
+static const int LOW_LATENCY_SOCKET_BUFFER = 1 << 20; // SO_RCVBUF/SO_SNDBUF in low-latency mode
+static const size_t LATENCY_WINDOW = 1024; // requests the server keeps latency percentiles over
+static const size_t CACHE_LINE_SIZE = 64;
+static const size_t SESSION_PATH_LEN = 576; // folder + the longest filename a request can carry
+static const size_t SESSION_WRITE_BUFFER = 8 * MAX_DATA_LEN; // WRQ data collected per write() call
+static const long DEFAULT_MAX_SESSIONS = 256; // concurrent sessions when TFTP_MAX_SESSIONS is unset
 static const char *SERVER_FOLDER = "server-files/"; // DO NOT CHANGE
 static const char *CLIENT_FOLDER = "client-files/"; // DO NOT CHANGE
\ No newline at end of file
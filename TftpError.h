@@ -4,6 +4,8 @@
 
 #define TFTP_ERROR_INVALID_ARGUMENT_COUNT 11
 #define TFTP_ERROR_INVALID_OPCODE 12
+#define TFTP_ERROR_TIMEOUT 13   // no answer after MAX_RETRY_COUNT retransmissions
+#define TFTP_ERROR_TRANSPORT 14 // the socket failed
 
 #define TFTP_ERROR_NOT_DEFINED 0
 #define TFTP_ERROR_FILE_NOT_FOUND 1
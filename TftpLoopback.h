@@ -0,0 +1,182 @@
+// TftpLoopback.h
+//
+// A deterministic in-memory network for the transfer engines in TftpTransfer.h. Two endpoints exchange
+// packets through a MemoryNetwork that can drop, duplicate and delay them, and time is a VirtualClock that
+// only moves when the simulation has nothing else to do. The same seed always gives the same run.
+#ifndef TFTP_LOOPBACK_H
+#define TFTP_LOOPBACK_H
+
+#include <queue>
+#include <random>
+#include <vector>
+#include "TftpTransfer.h"
+
+// Clock policy whose time is advanced by the simulation instead of passing on its own
+class VirtualClock
+{
+public:
+    using time_point = std::chrono::steady_clock::time_point;
+
+    time_point now() const { return current; }
+    void advanceTo(time_point when)
+    {
+        if (when > current)
+            current = when;
+    }
+
+private:
+    time_point current{};
+};
+
+// How the network treats each packet. Probabilities are in parts per million.
+struct LinkConditions
+{
+    uint32_t lossPpm = 0;
+    uint32_t duplicatePpm = 0;
+    std::chrono::microseconds latency{100};
+    std::chrono::microseconds jitter{0}; // extra random delay, which also reorders packets
+};
+
+// Counters kept by the network over one simulation
+struct NetworkStats
+{
+    uint64_t sent = 0;
+    uint64_t delivered = 0;
+    uint64_t dropped = 0;
+    uint64_t duplicated = 0;
+};
+
+class MemoryNetwork
+{
+public:
+    MemoryNetwork(VirtualClock &clock, const LinkConditions &conditions, uint64_t seed)
+        : clock(clock), conditions(conditions), rng(seed) {}
+
+    // Queue a packet from endpoint side (0 or 1) to the other endpoint
+    bool send(int side, const void *packet, size_t length)
+    {
+        counters.sent++;
+        if (chance(conditions.lossPpm))
+        {
+            counters.dropped++;
+            return true;
+        }
+
+        int copies = 1;
+        if (chance(conditions.duplicatePpm))
+        {
+            counters.duplicated++;
+            copies = 2;
+        }
+
+        for (int i = 0; i < copies; i++)
+        {
+            InFlight flight;
+            flight.deliverAt = clock.now() + conditions.latency;
+            if (conditions.jitter.count() > 0)
+                flight.deliverAt += std::chrono::microseconds(rng() % conditions.jitter.count());
+            flight.sequence = nextSequence++;
+            flight.to = 1 - side;
+            flight.length = std::min(length, sizeof(TftpPacketUnion));
+            flight.bytes.resize(flight.length);
+            memcpy(flight.bytes.data(), packet, flight.length);
+            inFlight.push(std::move(flight));
+        }
+        return true;
+    }
+
+    bool idle() const { return inFlight.empty(); }
+    VirtualClock::time_point nextDelivery() const { return inFlight.top().deliverAt; }
+
+    // Take the earliest packet off the network. Returns the endpoint it is addressed to.
+    int deliver(TftpPacketUnion &packet, size_t &length)
+    {
+        const InFlight &flight = inFlight.top();
+        int to = flight.to;
+        length = flight.length;
+        memcpy(reinterpret_cast<char *>(&packet), flight.bytes.data(), flight.length);
+        inFlight.pop();
+        counters.delivered++;
+        return to;
+    }
+
+    const NetworkStats &stats() const { return counters; }
+
+private:
+    struct InFlight
+    {
+        VirtualClock::time_point deliverAt;
+        uint64_t sequence; // keeps equal delivery times in send order
+        int to;
+        size_t length;
+        std::vector<char> bytes;
+
+        bool operator>(const InFlight &other) const
+        {
+            return deliverAt != other.deliverAt ? deliverAt > other.deliverAt : sequence > other.sequence;
+        }
+    };
+
+    bool chance(uint32_t ppm) { return ppm > 0 && rng() % 1000000 < ppm; }
+
+    VirtualClock &clock;
+    LinkConditions conditions;
+    std::mt19937_64 rng;
+    std::priority_queue<InFlight, std::vector<InFlight>, std::greater<InFlight>> inFlight;
+    uint64_t nextSequence = 0;
+    NetworkStats counters;
+};
+
+// Transport policy for one endpoint of a MemoryNetwork
+class MemoryTransport
+{
+public:
+    MemoryTransport(MemoryNetwork &network, int side) : network(network), side(side) {}
+
+    bool send(const void *packet, size_t length) { return network.send(side, packet, length); }
+
+private:
+    MemoryNetwork &network;
+    int side;
+};
+
+// Run two started engines against each other, the first on side 0 and the second on side 1, until
+// neither is active(). Like runTransfer(), an engine only gets packets while it is active, so a completed
+// receiver answers a retransmitted last block during its dally period and drops it afterwards.
+// Returns true if both completed.
+template <typename Engine0, typename Engine1>
+bool runSimulation(MemoryNetwork &network, VirtualClock &clock, Engine0 &engine0, Engine1 &engine1)
+{
+    TftpPacketUnion packet;
+    size_t length;
+
+    while (engine0.active() || engine1.active())
+    {
+        auto timer = std::min(engine0.deadline(), engine1.deadline());
+        if (network.idle() && timer == VirtualClock::time_point::max())
+            break;
+        if (!network.idle() && network.nextDelivery() <= timer)
+        {
+            clock.advanceTo(network.nextDelivery());
+            if (network.deliver(packet, length) == 0)
+            {
+                if (engine0.active())
+                    engine0.onPacket(packet, length);
+            }
+            else if (engine1.active())
+                engine1.onPacket(packet, length);
+        }
+        else
+        {
+            // Nothing in flight before the next timer, so jump straight to it
+            clock.advanceTo(timer);
+            if (engine0.deadline() <= clock.now())
+                engine0.onTimeout();
+            if (engine1.deadline() <= clock.now())
+                engine1.onTimeout();
+        }
+    }
+    return engine0.state() == TransferState::Complete && engine1.state() == TransferState::Complete;
+}
+
+#endif
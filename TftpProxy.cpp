@@ -0,0 +1,437 @@
+//
+// TFTP caching proxy - relays read requests to an upstream tftp-server and keeps the files
+// it fetched in proxy-files/ and in memory, so many downstream clients share one upstream fetch.
+//
+// Usage: TFTP_PROXY_PORT=61126 TFTP_SERVER_PORT=61125 ./tftp-proxy
+
+#include <sys/stat.h>
+#include <cerrno>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "TftpSession.h"
+#include "TftpTransfer.h"
+
+#define PROXY_UDP_PORT 61126
+#define SERV_UDP_PORT 61125
+#define SERV_HOST_ADDR "127.0.0.1"
+
+static const char *PROXY_FOLDER = "proxy-files/";
+static const size_t MEMORY_CACHE_LIMIT = 64 * 1024 * 1024; // bytes of file data kept in memory
+
+char *program;
+
+struct sockaddr_in upstream_addr;
+
+// A cached file. While the upstream fetch or disk load is in progress, data grows under lock and
+// waiting sessions are woken through updated. Once complete, data no longer changes.
+struct CacheEntry
+{
+    std::mutex lock;
+    std::condition_variable updated;
+    std::vector<char> data;
+    std::atomic<bool> complete{false}; // set under lock, also read under cacheLock when trimming
+    bool failed = false;
+    int errorCode = TFTP_ERROR_NOT_DEFINED;
+    std::string errorMessage = "Upstream transfer failed"; // replaced by the upstream's own ERROR, if it sent one
+    std::chrono::steady_clock::time_point lastUsed = std::chrono::steady_clock::now();
+};
+
+std::mutex cacheLock;
+std::unordered_map<std::string, std::shared_ptr<CacheEntry>> cache;
+size_t cachedBytes = 0;
+
+// Clients (address and port) with a session running. A retransmitted RRQ from one of them would start a
+// second session on another port, which the client ignores once it has latched the first one.
+std::mutex clientsLock;
+std::unordered_set<uint64_t> activeClients;
+
+uint64_t clientKey(const struct sockaddr_in &cli_addr)
+{
+    return static_cast<uint64_t>(ntohl(cli_addr.sin_addr.s_addr)) << 16 | ntohs(cli_addr.sin_port);
+}
+
+// Open a UDP socket on an ephemeral port, which becomes the proxy's TID for one transfer
+int openSessionSocket()
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+    {
+        perror("socket creation failed.");
+        return -1;
+    }
+    tuneSocketForLatency(sockfd);
+
+    struct sockaddr_in local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    local_addr.sin_port = htons(0);
+    if (bind(sockfd, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0)
+    {
+        perror("bind failed.");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// Drop complete entries nobody is reading from memory, least recently used first, until the
+// memory cache is back under its limit. The files stay on disk. Caller holds cacheLock.
+void trimMemoryCache()
+{
+    while (cachedBytes > MEMORY_CACHE_LIMIT)
+    {
+        auto victim = cache.end();
+        for (auto it = cache.begin(); it != cache.end(); ++it)
+        {
+            if (!it->second->complete || it->second.use_count() > 1)
+                continue;
+            if (victim == cache.end() || it->second->lastUsed < victim->second->lastUsed)
+                victim = it;
+        }
+        if (victim == cache.end())
+            return;
+
+        std::cout << "Evicting " << victim->first << " from memory cache" << std::endl;
+        cachedBytes -= victim->second->data.size();
+        cache.erase(victim);
+    }
+}
+
+// Persist a completed file to proxy-files/. Written to a temporary name first so a
+// concurrent startup never loads a partial file.
+void storeOnDisk(const std::string &filename, const std::vector<char> &data)
+{
+    std::string filePath = std::string(PROXY_FOLDER) + filename;
+    std::string tempPath = filePath + ".part";
+
+    std::ofstream file(tempPath, std::ios::binary);
+    if (!file.good())
+    {
+        std::cerr << "Unable to write cache file " << tempPath << std::endl;
+        return;
+    }
+    file.write(data.data(), data.size());
+    file.close();
+
+    if (rename(tempPath.c_str(), filePath.c_str()) != 0)
+        perror("Error renaming cache file");
+}
+
+// Fetch filename from the upstream server, publishing every block to entry as it arrives
+void fetchFromUpstream(std::string filename, std::shared_ptr<CacheEntry> entry)
+{
+    std::cout << "Cache miss, fetching " << filename << " from upstream" << std::endl;
+
+    bool complete = false;
+    int errorCode = TFTP_ERROR_NOT_DEFINED;
+    std::string errorMessage;
+    int sockfd = openSessionSocket();
+    if (sockfd >= 0)
+    {
+        UdpTransport transport(sockfd, upstream_addr, true);
+        SteadyClock clock;
+        TftpReceiver<UdpTransport, SteadyClock> receiver(transport, clock, [&entry](const char *data, size_t length)
+                                                         {
+                                                             std::lock_guard<std::mutex> guard(entry->lock);
+                                                             entry->data.insert(entry->data.end(), data, data + length);
+                                                             // A short block completes the file; waiting sessions need
+                                                             // not sit out the receiver's dally period
+                                                             if (length < MAX_DATA_LEN)
+                                                                 entry->complete = true;
+                                                             entry->updated.notify_all();
+                                                             return true;
+                                                         });
+        receiver.startWithRequest(filename.c_str());
+        complete = runTransfer(receiver, transport);
+        if (receiver.failedByPeer())
+        {
+            errorCode = receiver.errorCode();
+            errorMessage = receiver.errorMessage();
+        }
+        close(sockfd);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(entry->lock);
+        if (complete)
+            entry->complete = true;
+        else
+        {
+            entry->failed = true;
+            entry->errorCode = errorCode;
+            if (!errorMessage.empty())
+                entry->errorMessage = errorMessage;
+        }
+        entry->updated.notify_all();
+    }
+
+    if (complete)
+    {
+        // The entry no longer changes, so it is written out before taking cacheLock
+        std::cout << "Fetched " << filename << " (" << entry->data.size() << " bytes)" << std::endl;
+        storeOnDisk(filename, entry->data);
+
+        std::lock_guard<std::mutex> guard(cacheLock);
+        cachedBytes += entry->data.size();
+        trimMemoryCache();
+        return;
+    }
+
+    // Forget the failed fetch so the next request retries upstream
+    std::cout << "Upstream fetch of " << filename << " failed" << std::endl;
+    std::lock_guard<std::mutex> guard(cacheLock);
+    auto it = cache.find(filename);
+    if (it != cache.end() && it->second == entry)
+        cache.erase(it);
+}
+
+// Find filename in the memory cache, load it from disk, or start a single upstream fetch
+// that every concurrent request for the same file attaches to.
+std::shared_ptr<CacheEntry> lookupCache(const std::string &filename)
+{
+    std::shared_ptr<CacheEntry> entry;
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+
+        auto it = cache.find(filename);
+        if (it != cache.end())
+        {
+            it->second->lastUsed = std::chrono::steady_clock::now();
+            return it->second;
+        }
+
+        entry = std::make_shared<CacheEntry>();
+        cache[filename] = entry;
+    }
+
+    // Read the disk cache without holding cacheLock; concurrent requests for the same file wait on the entry
+    std::string filePath = std::string(PROXY_FOLDER) + filename;
+    std::ifstream file(filePath, std::ios::binary);
+    if (!file.is_open())
+    {
+        std::thread(fetchFromUpstream, filename, entry).detach();
+        return entry;
+    }
+
+    std::cout << "Loading " << filename << " from disk cache" << std::endl;
+    std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    size_t size = data.size();
+    {
+        std::lock_guard<std::mutex> guard(entry->lock);
+        entry->data.swap(data);
+        entry->complete = true;
+        entry->updated.notify_all();
+    }
+
+    std::lock_guard<std::mutex> guard(cacheLock);
+    cachedBytes += size;
+    trimMemoryCache();
+    return entry;
+}
+
+// Stream filename from the cache to the client, sending blocks as soon as they are available
+void serveFromCache(const char *filename, const struct sockaddr_in &cli_addr)
+{
+    std::shared_ptr<CacheEntry> entry = lookupCache(filename);
+
+    int sockfd = openSessionSocket();
+    if (sockfd < 0)
+        return;
+
+    // Hold back until the fetch has produced something, so an upstream error is passed on as is
+    int errorCode = TFTP_ERROR_NOT_DEFINED;
+    std::string errorMessage;
+    bool failedEmpty;
+    {
+        std::unique_lock<std::mutex> guard(entry->lock);
+        entry->updated.wait(guard, [&]
+                            { return entry->failed || entry->complete || !entry->data.empty(); });
+        failedEmpty = entry->failed && entry->data.empty();
+        errorCode = entry->errorCode;
+        errorMessage = entry->errorMessage;
+    }
+    if (failedEmpty)
+    {
+        handleErrorPacket(errorCode, errorMessage, sockfd, cli_addr, sizeof(cli_addr));
+        close(sockfd);
+        return;
+    }
+
+    // Stream blocks as soon as they are resident, waiting on the fetch for the rest
+    size_t offset = 0;
+    UdpTransport transport(sockfd, cli_addr, false);
+    SteadyClock clock;
+    TftpSender<UdpTransport, SteadyClock> sender(transport, clock, [&entry, &offset](char *buffer) -> ssize_t
+                                                 {
+                                                     std::unique_lock<std::mutex> guard(entry->lock);
+                                                     entry->updated.wait(guard, [&]
+                                                                         { return entry->failed || entry->complete || entry->data.size() >= offset + MAX_DATA_LEN; });
+                                                     if (entry->failed && entry->data.size() < offset + MAX_DATA_LEN)
+                                                         return -1;
+
+                                                     size_t bytesRead = std::min(entry->data.size() - offset, static_cast<size_t>(MAX_DATA_LEN));
+                                                     memcpy(buffer, entry->data.data() + offset, bytesRead);
+                                                     offset += bytesRead;
+                                                     return bytesRead;
+                                                 });
+    sender.start();
+    if (!runTransfer(sender, transport))
+        std::cout << "Transmission of " << filename << " aborted: " << sender.errorMessage() << std::endl;
+
+    close(sockfd);
+}
+
+// Serve one read request on its own thread, then hand its record back to the accepting thread's slab
+void serveReadRequest(SessionSlab &sessions, SessionRecord *session)
+{
+    serveFromCache(session->filename(), session->peer_addr);
+    {
+        std::lock_guard<std::mutex> guard(clientsLock);
+        activeClients.erase(clientKey(session->peer_addr));
+    }
+    sessions.release(session);
+}
+
+// Read a request that arrived while every session record is in use and tell the client to try again later
+void rejectRequest(int sockfd)
+{
+    TftpPacketUnion packet;
+    struct sockaddr_in cli_addr;
+    socklen_t cliLen = sizeof(cli_addr);
+    ssize_t receivedBytes = recvfrom(sockfd, &packet, MAX_PACKET_LEN, 0, (struct sockaddr *)&cli_addr, &cliLen);
+    if (receivedBytes < 0)
+    {
+        perror("Error receiving request packet");
+        return;
+    }
+    if (traceEnabled())
+        tracePacket(TRACE_RECEIVED, localAddressOf(sockfd), cli_addr, &packet, receivedBytes);
+
+    handleErrorPacket(TFTP_ERROR_NOT_DEFINED, "Too many sessions, try again later", sockfd, cli_addr, cliLen);
+}
+
+int main(int argc, char *argv[])
+{
+    program = argv[0];
+    startTracing(TRACE_PREOPENED_RINGS);
+
+    int sockfd;
+    struct sockaddr_in proxy_addr;
+
+    memset(&proxy_addr, 0, sizeof(proxy_addr));
+    memset(&upstream_addr, 0, sizeof(upstream_addr));
+
+    // Initialize the downstream listening address and the upstream server address
+    proxy_addr.sin_family = AF_INET;
+    proxy_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    proxy_addr.sin_port = htons(resolvePort("TFTP_PROXY_PORT", PROXY_UDP_PORT));
+
+    upstream_addr.sin_family = AF_INET;
+    upstream_addr.sin_addr.s_addr = inet_addr(SERV_HOST_ADDR);
+    upstream_addr.sin_port = htons(resolvePort("TFTP_SERVER_PORT", SERV_UDP_PORT));
+
+    if (mkdir(PROXY_FOLDER, 0755) != 0 && errno != EEXIST)
+    {
+        perror("Unable to create proxy-files");
+        exit(EXIT_FAILURE);
+    }
+
+    // Create UDP socket
+    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+    {
+        perror("socket creation failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Bind the socket
+    if (bind(sockfd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) < 0)
+    {
+        perror("bind failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    std::cout << "Proxy listening on port " << ntohs(proxy_addr.sin_port)
+              << ", upstream port " << ntohs(upstream_addr.sin_port) << std::endl;
+
+    // Every running session holds a record from this slab, so TFTP_MAX_SESSIONS bounds session memory
+    SessionSlab sessions(std::max(resolveNumber("TFTP_MAX_SESSIONS", DEFAULT_MAX_SESSIONS), 1L));
+    if (sessions.capacity() == 0)
+    {
+        std::cerr << "No session state for TFTP_MAX_SESSIONS sessions, set a lower limit" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::cout << "Up to " << sessions.capacity() << " sessions, " << SessionSlab::bytesPerSession()
+              << " bytes of session state each" << std::endl;
+
+    for (;;)
+    {
+        SessionRecord *session = sessions.acquire();
+        if (session == nullptr)
+        {
+            rejectRequest(sockfd);
+            continue;
+        }
+
+        // Receive the request straight into the session record
+        struct sockaddr_in &cli_addr = session->peer_addr;
+        session->requestLength = recvfrom(sockfd, &session->request, MAX_PACKET_LEN, 0, (struct sockaddr *)&cli_addr, &session->peerLen);
+        socklen_t cliLen = session->peerLen;
+        if (session->requestLength < 0)
+        {
+            perror("Error receiving request packet");
+            sessions.release(session);
+            continue;
+        }
+        if (traceEnabled())
+            tracePacket(TRACE_RECEIVED, localAddressOf(sockfd), cli_addr, &session->request, session->requestLength);
+
+        uint16_t opcode = ntohs(session->request.packet.opcode);
+
+        // Only read requests are relayed, the cache is never written to by clients
+        if (opcode == TFTP_WRQ)
+        {
+            handleErrorPacket(TFTP_ERROR_ACCESS_VIOLATION, "Proxy is read-only", sockfd, cli_addr, cliLen);
+            sessions.release(session);
+            continue;
+        }
+        if (opcode != TFTP_RRQ)
+        {
+            handleErrorPacket(TFTP_ERROR_ILLEGAL_OPERATION, "Illegal opcode", sockfd, cli_addr, cliLen);
+            sessions.release(session);
+            continue;
+        }
+
+        const char *filename = session->filename();
+        if (filename == nullptr || !isPlainFilename(filename))
+        {
+            handleErrorPacket(TFTP_ERROR_ACCESS_VIOLATION, "Invalid filename", sockfd, cli_addr, cliLen);
+            sessions.release(session);
+            continue;
+        }
+
+        // Drop a retransmitted request from a client that is already being served
+        bool retransmitted;
+        {
+            std::lock_guard<std::mutex> guard(clientsLock);
+            retransmitted = !activeClients.insert(clientKey(cli_addr)).second;
+        }
+        if (retransmitted)
+        {
+            sessions.release(session);
+            continue;
+        }
+
+        std::cout << "Requested filename is: " << filename << std::endl;
+        std::thread(serveReadRequest, std::ref(sessions), session).detach();
+    }
+
+    close(sockfd);
+    return 0;
+}
@@ -3,274 +3,231 @@
 //
 // TFTP server program over UDP - CSS432 - winter 2024
 
-#include "TftpCommon.h"
+#include <algorithm>
+#include <deque>
+#include <fcntl.h>
+#include "TftpSession.h"
+#include "TftpTransfer.h"
 
 #define SERV_UDP_PORT 61125
 
 char *program;
 
-int handleIncomingRequest(int sockfd)
+// Print the outcome of a finished transfer
+template <typename Engine>
+void reportTransfer(const Engine &engine)
 {
-    struct sockaddr_in cli_addr;
+    const TransferStats &stats = engine.stats();
+    if (engine.state() == TransferState::Complete)
+        std::cout << "Transfer complete: " << stats.blocks << " blocks, " << stats.bytes << " bytes, "
+                  << stats.retransmits << " retransmits" << std::endl;
+    else
+        std::cout << "Transfer failed: " << engine.errorMessage() << " (error code " << engine.errorCode() << ")" << std::endl;
+}
 
-    size_t receivedBytes;
-    socklen_t cliLen;
-    char mesg[MAX_PACKET_LEN];
+// End-to-end latency of recent requests, from receiving the request until the transfer ended
+class LatencyRecorder
+{
+public:
+    void record(std::chrono::microseconds firstBlock, std::chrono::microseconds total)
+    {
+        firstBlocks.push_back(firstBlock);
+        totals.push_back(total);
+        if (firstBlocks.size() > LATENCY_WINDOW)
+        {
+            firstBlocks.pop_front();
+            totals.pop_front();
+        }
 
-    for (;;)
+        std::cout << "Latency: first block " << firstBlock.count() << " us, total " << total.count() << " us (last "
+                  << firstBlocks.size() << " requests: first block p50 " << percentile(firstBlocks, 50).count()
+                  << " us, p99 " << percentile(firstBlocks, 99).count() << " us; total p50 "
+                  << percentile(totals, 50).count() << " us, p99 " << percentile(totals, 99).count() << " us)" << std::endl;
+    }
+
+private:
+    static std::chrono::microseconds percentile(const std::deque<std::chrono::microseconds> &samples, size_t p)
     {
-        std::cout << "\nWaiting to receive request\n"
-                  << std::endl;
+        std::vector<std::chrono::microseconds> sorted(samples.begin(), samples.end());
+        size_t rank = sorted.size() * p / 100;
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank];
+    }
+
+    std::deque<std::chrono::microseconds> firstBlocks;
+    std::deque<std::chrono::microseconds> totals;
+};
+
+// Record how long a finished transfer took from the moment its request arrived. startTime is when the
+// engine sent its first packet; the engine's own duration ends at the last block, before any dally.
+template <typename Engine>
+void recordLatency(LatencyRecorder &latency, std::chrono::steady_clock::time_point requestTime,
+                   std::chrono::steady_clock::time_point startTime, const Engine &engine)
+{
+    if (engine.state() != TransferState::Complete)
+        return;
+
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    auto setup = startTime - requestTime; // parsing, lookup and open before the first packet
+    latency.record(duration_cast<microseconds>(setup + engine.stats().firstBlockTime),
+                   duration_cast<microseconds>(setup + engine.stats().duration));
+}
+
+// Answer one request held in session. The record is returned to the slab by the caller.
+void serveRequest(int sockfd, FileIndex &index, SessionRecord &session, LatencyRecorder &latency)
+{
+    struct sockaddr_in &cli_addr = session.peer_addr;
+    socklen_t cliLen = session.peerLen;
+
+    // Parse the request packet
+    uint16_t opcode = ntohs(session.request.packet.opcode);
+
+    if (opcode < TFTP_RRQ || opcode > TFTP_ERROR)
+    {
+        std::cout << "Received message has an illegal opcode." << std::endl;
+        handleErrorPacket(TFTP_ERROR_ILLEGAL_OPERATION, "Illegal opcode", sockfd, cli_addr, cliLen);
+        exit(4);
+    }
+
+    // Stray DATA, ACK or ERROR packets from a finished transfer are not requests
+    if (opcode != TFTP_RRQ && opcode != TFTP_WRQ)
+        return;
+
+    // The index only knows names directly inside server-files/, so anything that could reach outside
+    // it is refused before the lookup, for reads and writes alike
+    const char *filename = session.filename();
+    if (filename == nullptr || !isPlainFilename(filename) || !session.setPath(SERVER_FOLDER, filename))
+    {
+        handleErrorPacket(TFTP_ERROR_ACCESS_VIOLATION, "Invalid filename", sockfd, cli_addr, cliLen);
+        return;
+    }
+    std::cout << "Requested filename is: " << filename << std::endl;
+
+    FileInfo fileInfo;
+    bool fileExists = index.lookup(filename, fileInfo);
+
+    UdpTransport transport(sockfd, cli_addr, false);
+    SteadyClock clock;
 
-        // Receive the 1st request packet from the client
-        cliLen = sizeof(cli_addr);
-        receivedBytes = recvfrom(sockfd, mesg, MAX_PACKET_LEN, 0, (struct sockaddr *)&cli_addr, &cliLen);
-        if (receivedBytes < 0)
+    if (opcode == TFTP_RRQ)
+    {
+        // Handle error code 1: file does not exist on server
+        if (!fileExists)
         {
-            perror("Error receiving request packet");
-            continue; // continue listening
+            std::cout << "The file does not exist." << std::endl;
+            handleErrorPacket(TFTP_ERROR_FILE_NOT_FOUND, "File does not exist", sockfd, cli_addr, cliLen);
+            return;
         }
 
-        // Parse the request packet
-        TftpPacketUnion receivedPkt;
-        memcpy(&receivedPkt, mesg, sizeof(TftpPacketUnion));
-        uint16_t opcode = ntohs(receivedPkt.dataPacket.opcode);
+        // Open file for read and start reading ahead of the network loop
+        FilePrefetcher file(session.path);
 
-        if (opcode < TFTP_RRQ || opcode > TFTP_ERROR)
+        // Handle file not found error
+        if (!file.isOpen())
         {
-            std::cout << "Received message has an illegal opcode." << std::endl;
-            handleErrorPacket(TFTP_ERROR_ILLEGAL_OPERATION, "Illegal opcode", sockfd, cli_addr, cliLen);
-            exit(4);
+            handleErrorPacket(TFTP_ERROR_FILE_NOT_FOUND, "File not found", sockfd, cli_addr, cliLen);
+            return;
         }
 
-        const char *filename = reinterpret_cast<char *>(receivedPkt.requestPacket.filename);
-        std::cout << "Requested filename is: " << filename << std::endl;
+        // File found, send the prefetched blocks to the client
+        TftpSender<UdpTransport, SteadyClock> sender(transport, clock, [&file](char *buffer)
+                                                     { return file.nextBlock(buffer); });
+        auto startTime = std::chrono::steady_clock::now();
+        sender.start();
+        runTransfer(sender, transport);
+        reportTransfer(sender);
+        recordLatency(latency, session.requestTime, startTime, sender);
+
+        // Report how often the sender had to wait for the disk
+        std::cout << "Sent " << fileInfo.size << " bytes, prefetch stalls: " << file.stallCount() << " ("
+                  << file.stallTime().count() << " us)" << std::endl;
+    }
+    else if (opcode == TFTP_WRQ)
+    {
+        // Handle error code 6: file already exists on server
+        if (fileExists)
+        {
+            std::cout << "The file already exists." << std::endl;
+            handleErrorPacket(TFTP_ERROR_FILE_EXISTS, "File already exists", sockfd, cli_addr, cliLen);
+            return;
+        }
 
-        std::string filePath = std::string(SERVER_FOLDER) + std::string(filename);
+        // Open file for write. O_EXCL keeps an index that has not caught up yet from overwriting a file.
+        int fd = open(session.path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0 && errno == EEXIST)
+        {
+            std::cout << "The file already exists." << std::endl;
+            handleErrorPacket(TFTP_ERROR_FILE_EXISTS, "File already exists", sockfd, cli_addr, cliLen);
+            return;
+        }
 
-        if (opcode == TFTP_RRQ)
+        // Handle file open error
+        if (fd < 0)
         {
-            // Handle error code 1: file does not exist on server
-            if (access(filePath.c_str(), F_OK) != 0)
-            {
-                std::cout << "The file does not exist." << std::endl;
-                handleErrorPacket(TFTP_ERROR_FILE_NOT_FOUND, "File does not exist", sockfd, cli_addr, cliLen);
-                continue;
-            }
-
-            // Open file for read
-            std::ifstream file(filePath, std::ios::binary);
-
-            // Handle file not found error
-            if (!file.is_open())
-            {
-                handleErrorPacket(TFTP_ERROR_FILE_NOT_FOUND, "File not found", sockfd, cli_addr, cliLen);
-                // Continue to the next iteration of the loop
-                continue;
-            }
-
-            // File found, proceed with sending data packets to the client
-
-            // Initialize local block number
-            uint16_t serverBlockNumber = 1;
-            bool isLastPacket = false;
-
-            while (!isLastPacket)
-            {
-                // Create a data packet
-                TftpDataPacket dataPacket;
-                dataPacket.opcode = htons(TFTP_DATA);
-
-                // Read data from the file into buffer and copy to data packet
-                char buffer[MAX_DATA_LEN];
-                file.read(buffer, MAX_DATA_LEN);
-                size_t bytesRead = file.gcount();
-
-                if (bytesRead < MAX_DATA_LEN)
-                    isLastPacket = true; // EOF reached, break the loop
-
-                if (bytesRead != 0)
-                {
-                    for (size_t i = 0; i < bytesRead; i++)
-                        dataPacket.data[i] = buffer[i];
-                }
-
-                for (int attempt = retryCount; attempt <= MAX_RETRY_COUNT; attempt++)
-                {
-                    try
-                    {
-                        // Send data packet to the client
-                        sendDataPacket(sockfd, dataPacket, serverBlockNumber, cli_addr, cliLen);
-
-                        // Start the timer and set for 1 sec
-                        registerTimeoutHandler();
-                        alarm(1);
-
-                        // Wait for ACK from the client with the block number that the client successfully received
-                        TftpAckPacket ackPacket;
-                        ssize_t bytesReceived = recvfrom(sockfd, &ackPacket, sizeof(TftpAckPacket), 0, (struct sockaddr *)&cli_addr, &cliLen);
-                        uint16_t receivedBlockNumber = ntohs(ackPacket.blockNumber);
-
-                        if (receivedBlockNumber != serverBlockNumber)
-                        {
-                            std::cerr << "Unexpected ACK received. Expected: " << serverBlockNumber << ", Received: " << receivedBlockNumber << std::endl;
-                            break;
-                        }
-
-                        // Clear the timer after receiving the packet and reset retry count
-                        alarm(0);
-                        retryCount = 0;
-
-                        std::cout << "Received ACK #" << receivedBlockNumber << std::endl;
-                        // Increment local block number for the next data block
-                        serverBlockNumber++;
-                        break;
-                    }
-                    catch (const std::exception &e)
-                    {
-                        std::cerr << e.what() << '\n';
-
-                        if (attempt < MAX_RETRY_COUNT)
-                        {
-                            std::cout << "Retransmitting #" << serverBlockNumber << std::endl;
-                            std::this_thread::sleep_for(std::chrono::milliseconds(200));
-                        }
-                    }
-                }
-            }
-
-            // Close the file after sending all data
-            file.close();
+            handleErrorPacket(TFTP_ERROR_ACCESS_VIOLATION, "Unable to open file for write", sockfd, cli_addr, cliLen);
+            return;
         }
-        else if (opcode == TFTP_WRQ)
+
+        // File open successful, acknowledge the WRQ and collect the received blocks in the session's write
+        // buffer. The last block is flushed before it is acknowledged, so a failed write reaches the client.
+        TftpReceiver<UdpTransport, SteadyClock> receiver(transport, clock, [&session, fd](const char *data, size_t length)
+                                                         {
+                                                             return session.bufferWrite(fd, data, length) &&
+                                                                    (length == MAX_DATA_LEN || session.flushWrites(fd));
+                                                         });
+        auto startTime = std::chrono::steady_clock::now();
+        receiver.start();
+        bool complete = runTransfer(receiver, transport);
+        reportTransfer(receiver);
+        recordLatency(latency, session.requestTime, startTime, receiver);
+
+        // Close the file after receiving all data, dropping a partial upload so it can be retried
+        close(fd);
+        if (!complete)
+            remove(session.path);
+
+        // Record the result without waiting for inotify
+        index.update(filename);
+    }
+}
+
+int handleIncomingRequest(int sockfd, FileIndex &index, SessionSlab &sessions)
+{
+    LatencyRecorder latency;
+
+    for (;;)
+    {
+        std::cout << "\nWaiting to receive request\n"
+                  << std::endl;
+
+        // Receive the 1st request packet from the client straight into a session record
+        SessionRecord *session = sessions.acquire();
+        if (session == nullptr)
         {
-            // Handle error code 6: file already exists on server
-            if (access(filePath.c_str(), F_OK) == 0)
-            {
-                std::cout << "The file already exists." << std::endl;
-                handleErrorPacket(TFTP_ERROR_FILE_EXISTS, "File already exists", sockfd, cli_addr, cliLen);
-                continue;
-            }
-
-            // Open file for write
-            std::ofstream file;
-            file.open(filePath, std::ios::binary);
-
-            // Handle file open error
-            if (!file.good())
-            {
-                handleErrorPacket(TFTP_ERROR_ACCESS_VIOLATION, "Unable to open file for write", sockfd, cli_addr, cliLen);
-                // Continue to the next iteration of the loop
-                continue;
-            }
-
-            // File open successful, proceed with receiving data packets from the client
-
-            // Initialize local block number
-            uint16_t serverBlockNumber = 0;
-
-            // Acknowledge the WRQ by sending an initial ACK with block number 0
-            sendAckPacket(sockfd, serverBlockNumber, cli_addr, cliLen);
-            serverBlockNumber++;
-
-            char buffer[MAX_DATA_LEN];
-            bool isLastPacket = false;
-            if (registerTimeoutHandler() == -1)
-                exit(1);
-
-            // Receive data packets and write data to the file
-            while (!isLastPacket)
-            {
-                // Start the timer and set for 1 sec
-                alarm(1);
-
-                // Receive data packet from the client
-                TftpDataPacket dataPacket;
-                ssize_t bytesReceived = recvfrom(sockfd, &dataPacket, sizeof(TftpDataPacket), 0, (struct sockaddr *)&cli_addr, &cliLen);
-
-                if (bytesReceived < 0)
-                {
-                    if (errno == EINTR)
-                    {
-                        printf("Receive timed out\n");
-                        alarm(0);
-
-                        if (retryCount < MAX_RETRY_COUNT)
-                        {
-                            printf("Retransmitting packet...\n");
-                            sendAckPacket(sockfd, serverBlockNumber, cli_addr, cliLen);
-                        }
-                        else
-                        {
-                            printf("Transmission aborted\n");
-                            retryCount = 0; // Reset retry count for next attempt
-                            break;
-                        }
-                    }
-                    else
-                    {
-                        perror("recvfrom failed");
-                        break;
-                    }
-                }
-                else if (bytesReceived > 0)
-                {
-                    alarm(0);       // Cancel timer
-                    retryCount = 0; // Reset retry count for next attempt
-                    uint16_t receivedBlockNumber = ntohs(dataPacket.blockNumber);
-
-                    // Check if the acknowledgment has the expected block number
-                    if (receivedBlockNumber == serverBlockNumber)
-                    {
-                        std::cout << strlen(dataPacket.data) << std::endl;
-                        if (strlen(dataPacket.data) == 0)
-                            break;
-
-                        std::cout << "Received block #" << receivedBlockNumber << std::endl;
-                        memcpy(buffer, dataPacket.data, MAX_DATA_LEN);
-
-                        // Write data to the file
-                        if (strlen(dataPacket.data) == MAX_DATA_LEN + 1)
-                            file.write(dataPacket.data, MAX_DATA_LEN);
-                        else
-                        {
-                            file.write(dataPacket.data, strlen(dataPacket.data));
-                            isLastPacket = true;
-                        }
-                        file.flush();
-
-                        // Acknowledge the received data block
-                        sendAckPacket(sockfd, serverBlockNumber, cli_addr, cliLen);
-
-                        // Check if it is the last data block
-                        if (strlen(dataPacket.data) <= MAX_DATA_LEN)
-                        {
-                            isLastPacket = true;
-                            break;
-                        }
-
-                        // Increment local block number for the next ACK
-                        serverBlockNumber++;
-                    }
-                    else
-                    {
-                        std::cerr << "Unexpected block number received." << receivedBlockNumber << serverBlockNumber << std::endl;
-                        // Send error packet to the client
-                        handleErrorPacket(TFTP_ERROR_NOT_DEFINED, "Unexpected block number received", sockfd, cli_addr, cliLen);
-                        break;
-                    }
-                }
-            }
-
-            // Close the file after receiving all data
-            file.close();
+            std::cerr << "No free session record" << std::endl;
+            exit(EXIT_FAILURE);
         }
+        session->requestLength = receiveFrom(sockfd, &session->request, MAX_PACKET_LEN, session->peer_addr, session->peerLen);
+        session->requestTime = std::chrono::steady_clock::now();
+        if (session->requestLength < 0)
+        {
+            perror("Error receiving request packet");
+            sessions.release(session);
+            continue; // continue listening
+        }
+        if (traceEnabled())
+            tracePacket(TRACE_RECEIVED, localAddressOf(sockfd), session->peer_addr, &session->request, session->requestLength);
+
+        serveRequest(sockfd, index, *session, latency);
+        sessions.release(session);
     }
 }
 
 int main(int argc, char *argv[])
 {
     program = argv[0];
+    startTracing(1);
 
     int sockfd;
     struct sockaddr_in serv_addr;
@@ -289,6 +246,7 @@ int main(int argc, char *argv[])
         perror("socket creation failed.");
         exit(EXIT_FAILURE);
     }
+    tuneSocketForLatency(sockfd);
 
     // Bind the socket
     if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
@@ -297,7 +255,15 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    handleIncomingRequest(sockfd);
+    // Index server-files/ so requests are answered without touching the filesystem
+    FileIndex index(SERVER_FOLDER);
+
+    // Requests are served one at a time, so one record is all the server ever holds
+    SessionSlab sessions(1);
+    if (sessions.capacity() == 0)
+        exit(EXIT_FAILURE); // the slab has already said why
+
+    handleIncomingRequest(sockfd, index, sessions);
 
     close(sockfd);
     return 0;
@@ -0,0 +1,154 @@
+// TftpSession.h
+//
+// Per-session state drawn from a slab, so accepting a request allocates nothing. Each worker that accepts
+// requests owns a SessionSlab: one mapping made at startup that holds a fixed number of cache-line-aligned
+// SessionRecords with the request packet, the file path and the write buffer inside them. The slab size is
+// the session cap, so it also bounds how much memory sessions can use. Records are handed out by the owning
+// worker only, but any thread may give one back when its session ends.
+#ifndef TFTP_SESSION_H
+#define TFTP_SESSION_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <new>
+#include <sys/mman.h>
+#include "TftpCommon.h"
+
+struct alignas(CACHE_LINE_SIZE) SessionRecord
+{
+    // The request as received, then whatever the session needs to parse from it
+    TftpPacketUnion request;
+    ssize_t requestLength = 0;
+    struct sockaddr_in peer_addr;
+    socklen_t peerLen = sizeof(peer_addr);
+    std::chrono::steady_clock::time_point requestTime;
+
+    // SERVER_FOLDER + filename, NUL-terminated
+    alignas(CACHE_LINE_SIZE) char path[SESSION_PATH_LEN];
+
+    // Received blocks are collected here and written to the file a few at a time
+    alignas(CACHE_LINE_SIZE) char writeBuffer[SESSION_WRITE_BUFFER];
+    size_t buffered = 0;
+
+    SessionRecord *nextFree = nullptr;
+
+    // The filename in the request, or nullptr if it is not NUL-terminated inside the packet
+    const char *filename() const
+    {
+        size_t available = requestLength > 2 ? requestLength - 2 : 0;
+        const char *name = request.requestPacket.filename;
+        return available > 0 && memchr(name, '\0', std::min(available, sizeof(request.requestPacket.filename))) != nullptr ? name : nullptr;
+    }
+
+    // Fill path with folder + name. Returns false if it does not fit.
+    bool setPath(const char *folder, const char *name)
+    {
+        int length = snprintf(path, sizeof(path), "%s%s", folder, name);
+        return length >= 0 && static_cast<size_t>(length) < sizeof(path);
+    }
+
+    // Append a block to writeBuffer, writing the buffer to fd first if the block does not fit
+    bool bufferWrite(int fd, const char *data, size_t length)
+    {
+        if (buffered + length > sizeof(writeBuffer) && !flushWrites(fd))
+            return false;
+        memcpy(writeBuffer + buffered, data, length);
+        buffered += length;
+        return true;
+    }
+
+    // Write everything collected in writeBuffer to fd
+    bool flushWrites(int fd)
+    {
+        size_t written = 0;
+        while (written < buffered)
+        {
+            ssize_t bytesWritten = write(fd, writeBuffer + written, buffered - written);
+            if (bytesWritten < 0 && errno == EINTR)
+                continue;
+            if (bytesWritten < 0)
+                return false;
+            written += bytesWritten;
+        }
+        buffered = 0;
+        return true;
+    }
+};
+
+class SessionSlab
+{
+public:
+    // Map room for capacity records up front, so the session cap is also a memory bound
+    explicit SessionSlab(size_t capacity) : count(capacity)
+    {
+        mappedSize = std::max(capacity, static_cast<size_t>(1)) * sizeof(SessionRecord);
+        void *mapped = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (mapped == MAP_FAILED)
+        {
+            perror("Unable to map session slab");
+            count = 0;
+            return;
+        }
+
+        records = static_cast<SessionRecord *>(mapped);
+        for (size_t i = count; i > 0; i--)
+        {
+            SessionRecord *record = new (&records[i - 1]) SessionRecord();
+            record->nextFree = freeList;
+            freeList = record;
+        }
+    }
+
+    ~SessionSlab()
+    {
+        if (records != nullptr)
+            munmap(records, mappedSize);
+    }
+
+    SessionSlab(const SessionSlab &) = delete;
+    SessionSlab &operator=(const SessionSlab &) = delete;
+
+    // Take a free record, or nullptr once capacity sessions are running. Only the owning worker may call this.
+    SessionRecord *acquire()
+    {
+        if (freeList == nullptr)
+            freeList = returned.exchange(nullptr, std::memory_order_acquire);
+
+        SessionRecord *record = freeList;
+        if (record == nullptr)
+            return nullptr;
+        freeList = record->nextFree;
+        active.fetch_add(1, std::memory_order_relaxed);
+
+        record->requestLength = 0;
+        record->peerLen = sizeof(record->peer_addr);
+        record->path[0] = '\0';
+        record->buffered = 0;
+        return record;
+    }
+
+    // Give a record back. Safe from any thread; the owner picks returned records up on its next acquire().
+    void release(SessionRecord *record)
+    {
+        active.fetch_sub(1, std::memory_order_relaxed);
+        record->nextFree = returned.load(std::memory_order_relaxed);
+        while (!returned.compare_exchange_weak(record->nextFree, record, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    size_t capacity() const { return count; }
+    size_t inUse() const { return active.load(std::memory_order_relaxed); }
+    static constexpr size_t bytesPerSession() { return sizeof(SessionRecord); }
+
+private:
+    SessionRecord *records = nullptr;
+    size_t count;
+    size_t mappedSize = 0;
+    SessionRecord *freeList = nullptr;             // owner only
+    std::atomic<SessionRecord *> returned{nullptr}; // pushed by any thread, taken whole by the owner
+    std::atomic<size_t> active{0};
+};
+
+#endif
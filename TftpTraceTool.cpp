@@ -0,0 +1,409 @@
+//
+// TFTP trace analyzer - reads the ring files written with TFTP_TRACE_DIR and reconstructs what happened
+// in each session.
+//
+// Usage: ./tftp-trace summary <trace files...>   per-session timing, RTT, retransmits and stall causes
+//        ./tftp-trace timeline <trace files...>  every packet, per session
+//        ./tftp-trace rtt <trace files...>       RTT series as CSV
+//        ./tftp-trace pcap <out.pcap> <trace files...>
+//
+// Only packet headers are traced, so exported packets carry the opcode and block number followed by zeros.
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <vector>
+#include "TftpCommon.h"
+
+char *program;
+
+struct TracedPacket
+{
+    TraceRecord record;
+    int64_t realtimeOffsetNs;
+    uint32_t pid;
+};
+
+// Local and peer address/port of one transfer, as seen by one process
+struct SessionKey
+{
+    uint32_t pid;
+    uint32_t localAddr;
+    uint16_t localPort;
+    uint32_t peerAddr;
+    uint16_t peerPort;
+
+    bool operator<(const SessionKey &other) const
+    {
+        return std::tie(pid, localAddr, localPort, peerAddr, peerPort) <
+               std::tie(other.pid, other.localAddr, other.localPort, other.peerAddr, other.peerPort);
+    }
+};
+
+// Read every record still held in a trace ring, oldest first
+bool loadTraceFile(const char *path, std::vector<TracedPacket> &packets)
+{
+    std::ifstream file(path, std::ios::binary);
+    TraceFileHeader header;
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || header.recordSize != sizeof(TraceRecord))
+    {
+        std::cerr << path << ": not a trace file" << std::endl;
+        return false;
+    }
+
+    // The header is only trusted as far as the file backs it up, so a truncated or corrupt file is reported
+    file.seekg(0, std::ios::end);
+    std::streamoff fileSize = file.tellg();
+    if (fileSize < static_cast<std::streamoff>(sizeof(header)) || header.capacity == 0 ||
+        header.capacity > (static_cast<uint64_t>(fileSize) - sizeof(header)) / sizeof(TraceRecord))
+    {
+        std::cerr << path << ": truncated trace file" << std::endl;
+        return false;
+    }
+
+    std::vector<TraceRecord> ring(header.capacity);
+    file.seekg(sizeof(header));
+    if (!file.read(reinterpret_cast<char *>(ring.data()), ring.size() * sizeof(TraceRecord)))
+    {
+        std::cerr << path << ": unable to read trace records" << std::endl;
+        return false;
+    }
+
+    uint64_t count = std::min(header.next, header.capacity);
+    uint64_t first = header.next - count;
+    for (uint64_t i = first; i < header.next; i++)
+        packets.push_back(TracedPacket{ring[i % header.capacity], header.realtimeOffsetNs, header.pid});
+    return true;
+}
+
+std::string opcodeName(uint16_t opcode)
+{
+    switch (opcode)
+    {
+    case TFTP_RRQ:
+        return "RRQ";
+    case TFTP_WRQ:
+        return "WRQ";
+    case TFTP_DATA:
+        return "DATA";
+    case TFTP_ACK:
+        return "ACK";
+    case TFTP_ERROR:
+        return "ERROR";
+    default:
+        return "op" + std::to_string(opcode);
+    }
+}
+
+// Opcode and block, or error code for ERROR
+std::string describe(const TraceRecord &record)
+{
+    if (record.opcode == TFTP_RRQ || record.opcode == TFTP_WRQ)
+        return opcodeName(record.opcode);
+    if (record.opcode == TFTP_ERROR)
+        return "ERROR code " + std::to_string(record.blockNumber);
+    return opcodeName(record.opcode) + " #" + std::to_string(record.blockNumber);
+}
+
+std::string sessionName(const SessionKey &key)
+{
+    char local[INET_ADDRSTRLEN], peer[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &key.localAddr, local, sizeof(local));
+    inet_ntop(AF_INET, &key.peerAddr, peer, sizeof(peer));
+    return "pid " + std::to_string(key.pid) + " " + local + ":" + std::to_string(ntohs(key.localPort)) +
+           " <-> " + peer + ":" + std::to_string(ntohs(key.peerPort));
+}
+
+// The reply that answers a sent packet, and so ends one RTT sample
+bool answers(const TraceRecord &sent, const TraceRecord &received)
+{
+    switch (sent.opcode)
+    {
+    case TFTP_RRQ:
+        return received.opcode == TFTP_DATA || received.opcode == TFTP_ERROR;
+    case TFTP_WRQ:
+        return received.opcode == TFTP_ACK || received.opcode == TFTP_ERROR;
+    case TFTP_DATA:
+        return received.opcode == TFTP_ACK && received.blockNumber == sent.blockNumber;
+    case TFTP_ACK:
+        return received.opcode == TFTP_DATA && received.blockNumber == static_cast<uint16_t>(sent.blockNumber + 1);
+    default:
+        return false;
+    }
+}
+
+struct SessionAnalysis
+{
+    uint64_t sent = 0, received = 0, bytes = 0, retransmits = 0;
+    std::vector<std::pair<uint16_t, uint64_t>> rtts; // block, RTT in ns
+    std::vector<uint64_t> retransmitGaps;
+    uint64_t peerWaitNs = 0, localNs = 0, timeoutNs = 0;
+    std::vector<std::tuple<uint64_t, std::string, size_t>> stalls; // gap, cause, packet index
+};
+
+SessionAnalysis analyzeSession(const std::vector<TraceRecord> &timeline)
+{
+    SessionAnalysis result;
+    const TraceRecord *lastSent = nullptr;
+    bool ambiguous = false; // a retransmitted packet's reply cannot be matched to one send (Karn)
+
+    for (size_t i = 0; i < timeline.size(); i++)
+    {
+        const TraceRecord &record = timeline[i];
+        if (record.direction == TRACE_SENT)
+        {
+            result.sent++;
+            if (record.opcode == TFTP_DATA)
+                result.bytes += record.length - 4;
+
+            bool retransmit = lastSent != nullptr && lastSent->opcode == record.opcode && lastSent->blockNumber == record.blockNumber;
+            if (retransmit)
+            {
+                result.retransmits++;
+                result.retransmitGaps.push_back(record.timestampNs - lastSent->timestampNs);
+            }
+            ambiguous = retransmit;
+            lastSent = &record;
+        }
+        else
+        {
+            result.received++;
+            if (lastSent != nullptr && answers(*lastSent, record))
+            {
+                if (!ambiguous)
+                    result.rtts.emplace_back(record.blockNumber, record.timestampNs - lastSent->timestampNs);
+                lastSent = nullptr;
+            }
+        }
+
+        // Attribute the time since the previous packet to whoever we were waiting on
+        if (i == 0)
+            continue;
+        const TraceRecord &previous = timeline[i - 1];
+        uint64_t gap = record.timestampNs - previous.timestampNs;
+        std::string cause;
+        if (previous.direction == TRACE_SENT && record.direction == TRACE_SENT &&
+            previous.opcode == record.opcode && previous.blockNumber == record.blockNumber)
+        {
+            cause = "retransmit timeout";
+            result.timeoutNs += gap;
+        }
+        else if (previous.direction == TRACE_SENT || record.direction == TRACE_RECEIVED)
+        {
+            cause = "waiting for peer";
+            result.peerWaitNs += gap;
+        }
+        else
+        {
+            cause = "local processing";
+            result.localNs += gap;
+        }
+        result.stalls.emplace_back(gap, cause, i);
+    }
+
+    std::sort(result.stalls.rbegin(), result.stalls.rend());
+    return result;
+}
+
+std::map<SessionKey, std::vector<TraceRecord>> groupSessions(const std::vector<TracedPacket> &packets)
+{
+    std::map<SessionKey, std::vector<TraceRecord>> sessions;
+    for (const TracedPacket &packet : packets)
+    {
+        const TraceRecord &record = packet.record;
+        sessions[SessionKey{packet.pid, record.localAddr, record.localPort, record.peerAddr, record.peerPort}].push_back(record);
+    }
+    for (auto &session : sessions)
+    {
+        std::stable_sort(session.second.begin(), session.second.end(), [](const TraceRecord &a, const TraceRecord &b)
+                         { return a.timestampNs < b.timestampNs; });
+    }
+    return sessions;
+}
+
+double toMs(uint64_t ns) { return ns / 1e6; }
+
+void printSummary(const std::map<SessionKey, std::vector<TraceRecord>> &sessions)
+{
+    for (const auto &session : sessions)
+    {
+        const std::vector<TraceRecord> &timeline = session.second;
+        SessionAnalysis analysis = analyzeSession(timeline);
+        uint64_t duration = timeline.back().timestampNs - timeline.front().timestampNs;
+
+        std::cout << "Session " << sessionName(session.first) << std::endl;
+        std::cout << "  " << timeline.size() << " packets (" << analysis.sent << " sent, " << analysis.received
+                  << " received), " << analysis.bytes << " data bytes sent, " << toMs(duration) << " ms" << std::endl;
+
+        if (!analysis.rtts.empty())
+        {
+            std::vector<uint64_t> sorted;
+            for (const auto &rtt : analysis.rtts)
+                sorted.push_back(rtt.second);
+            std::sort(sorted.begin(), sorted.end());
+            std::cout << "  RTT ms: min " << toMs(sorted.front()) << ", p50 " << toMs(sorted[sorted.size() / 2])
+                      << ", p99 " << toMs(sorted[sorted.size() * 99 / 100]) << ", max " << toMs(sorted.back())
+                      << " over " << sorted.size() << " samples" << std::endl;
+        }
+
+        std::cout << "  Retransmits: " << analysis.retransmits;
+        for (size_t i = 0; i < analysis.retransmitGaps.size() && i < 10; i++)
+            std::cout << (i == 0 ? " (gaps ms: " : ", ") << toMs(analysis.retransmitGaps[i]);
+        std::cout << (analysis.retransmitGaps.empty() ? "" : analysis.retransmitGaps.size() > 10 ? ", ...)" : ")") << std::endl;
+
+        std::cout << "  Time waiting for peer " << toMs(analysis.peerWaitNs) << " ms, local processing "
+                  << toMs(analysis.localNs) << " ms, retransmit timeouts " << toMs(analysis.timeoutNs) << " ms" << std::endl;
+
+        for (size_t i = 0; i < analysis.stalls.size() && i < 3; i++)
+        {
+            const auto &stall = analysis.stalls[i];
+            const TraceRecord &record = timeline[std::get<2>(stall)];
+            std::cout << "  Stall " << toMs(std::get<0>(stall)) << " ms before "
+                      << (record.direction == TRACE_SENT ? "sending " : "receiving ") << describe(record) << ": " << std::get<1>(stall) << std::endl;
+        }
+    }
+}
+
+void printTimeline(const std::map<SessionKey, std::vector<TraceRecord>> &sessions)
+{
+    for (const auto &session : sessions)
+    {
+        std::cout << "Session " << sessionName(session.first) << std::endl;
+        uint64_t start = session.second.front().timestampNs;
+        for (const TraceRecord &record : session.second)
+        {
+            printf("  %12.3f ms  %s %-14s %u bytes\n", toMs(record.timestampNs - start),
+                   record.direction == TRACE_SENT ? "->" : "<-", describe(record).c_str(), record.length);
+        }
+    }
+}
+
+void printRtt(const std::map<SessionKey, std::vector<TraceRecord>> &sessions)
+{
+    std::cout << "session,block,rtt_us" << std::endl;
+    for (const auto &session : sessions)
+    {
+        std::string name = sessionName(session.first);
+        for (const auto &rtt : analyzeSession(session.second).rtts)
+            std::cout << '"' << name << "\"," << rtt.first << "," << rtt.second / 1000.0 << std::endl;
+    }
+}
+
+uint16_t ipChecksum(const unsigned char *header, size_t length)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < length; i += 2)
+        sum += header[i] << 8 | header[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return static_cast<uint16_t>(~sum);
+}
+
+// Write the packets as IPv4/UDP datagrams in a pcap file (LINKTYPE_RAW)
+bool writePcap(const char *path, std::vector<TracedPacket> packets)
+{
+    std::ofstream out(path, std::ios::binary);
+    if (!out.good())
+    {
+        std::cerr << "Unable to write " << path << std::endl;
+        return false;
+    }
+
+    std::stable_sort(packets.begin(), packets.end(), [](const TracedPacket &a, const TracedPacket &b)
+                     { return a.record.timestampNs + a.realtimeOffsetNs < b.record.timestampNs + b.realtimeOffsetNs; });
+
+    uint32_t globalHeader[6] = {0xa1b2c3d4, 0x00040002, 0, 0, 65535, 101};
+    out.write(reinterpret_cast<const char *>(globalHeader), sizeof(globalHeader));
+
+    uint16_t ipId = 0;
+    for (const TracedPacket &packet : packets)
+    {
+        const TraceRecord &record = packet.record;
+
+        // A socket bound to INADDR_ANY talking over loopback was on 127.0.0.1
+        uint32_t localAddr = record.localAddr;
+        if (localAddr == 0 && (ntohl(record.peerAddr) >> 24) == 127)
+            localAddr = htonl(INADDR_LOOPBACK);
+        bool sent = record.direction == TRACE_SENT;
+        uint32_t source = sent ? localAddr : record.peerAddr, destination = sent ? record.peerAddr : localAddr;
+        uint16_t sourcePort = sent ? record.localPort : record.peerPort, destinationPort = sent ? record.peerPort : record.localPort;
+
+        std::vector<unsigned char> datagram(20 + 8 + record.length, 0);
+        unsigned char *ip = datagram.data();
+        ip[0] = 0x45;
+        ip[2] = datagram.size() >> 8;
+        ip[3] = datagram.size() & 0xff;
+        ip[4] = ipId >> 8;
+        ip[5] = ipId & 0xff;
+        ipId++;
+        ip[6] = 0x40; // don't fragment
+        ip[8] = 64;
+        ip[9] = IPPROTO_UDP;
+        memcpy(ip + 12, &source, 4);
+        memcpy(ip + 16, &destination, 4);
+        uint16_t checksum = ipChecksum(ip, 20);
+        ip[10] = checksum >> 8;
+        ip[11] = checksum & 0xff;
+
+        unsigned char *udp = ip + 20;
+        uint16_t udpLength = htons(8 + record.length);
+        memcpy(udp, &sourcePort, 2);
+        memcpy(udp + 2, &destinationPort, 2);
+        memcpy(udp + 4, &udpLength, 2); // checksum left at 0, which means none for IPv4
+
+        unsigned char *tftp = udp + 8;
+        if (record.length >= 2)
+        {
+            tftp[0] = record.opcode >> 8;
+            tftp[1] = record.opcode & 0xff;
+        }
+        if (record.length >= 4)
+        {
+            tftp[2] = record.blockNumber >> 8;
+            tftp[3] = record.blockNumber & 0xff;
+        }
+
+        uint64_t realtimeNs = record.timestampNs + packet.realtimeOffsetNs;
+        uint32_t packetHeader[4] = {static_cast<uint32_t>(realtimeNs / 1000000000), static_cast<uint32_t>(realtimeNs % 1000000000 / 1000),
+                                    static_cast<uint32_t>(datagram.size()), static_cast<uint32_t>(datagram.size())};
+        out.write(reinterpret_cast<const char *>(packetHeader), sizeof(packetHeader));
+        out.write(reinterpret_cast<const char *>(datagram.data()), datagram.size());
+    }
+
+    std::cout << "Wrote " << packets.size() << " packets to " << path << std::endl;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    program = argv[0];
+
+    std::string command = argc > 1 ? argv[1] : "";
+    int firstFile = command == "pcap" ? 3 : 2;
+    if ((command != "summary" && command != "timeline" && command != "rtt" && command != "pcap") || argc <= firstFile)
+    {
+        std::cerr << "Usage: " << argv[0] << " <summary|timeline|rtt> <trace files...>" << std::endl
+                  << "       " << argv[0] << " pcap <out.pcap> <trace files...>" << std::endl;
+        return 1;
+    }
+
+    std::vector<TracedPacket> packets;
+    for (int i = firstFile; i < argc; i++)
+    {
+        if (!loadTraceFile(argv[i], packets))
+            return 1;
+    }
+
+    if (command == "pcap")
+        return writePcap(argv[2], packets) ? 0 : 1;
+
+    std::map<SessionKey, std::vector<TraceRecord>> sessions = groupSessions(packets);
+    if (command == "summary")
+        printSummary(sessions);
+    else if (command == "timeline")
+        printTimeline(sessions);
+    else
+        printRtt(sessions);
+    return 0;
+}
@@ -0,0 +1,387 @@
+// TftpTransfer.h
+//
+// The stop-and-wait transfer logic shared by the server, the client and the proxy. TftpSender sends DATA
+// and waits for ACKs, TftpReceiver acknowledges DATA. Both are state machines fed one packet or one timeout
+// at a time, so they do not know where packets come from or what time it is:
+//
+//   Transport: bool send(const void *packet, size_t length)
+//   Clock:     typename Clock::time_point now() const
+//
+// runTransfer() drives an engine over a blocking transport such as UdpTransport. TftpLoopback.h drives two
+// engines against each other over an in-memory network with a virtual clock. Drivers keep an engine going
+// while it is active(), which for a receiver includes dallying after the last ACK, so a retransmitted last
+// block is acknowledged again when that ACK was lost.
+#ifndef TFTP_TRANSFER_H
+#define TFTP_TRANSFER_H
+
+#include "TftpCommon.h"
+
+enum class TransferState
+{
+    Running,
+    Complete,
+    Failed
+};
+
+// Counters kept by an engine over one transfer
+struct TransferStats
+{
+    uint64_t packetsSent = 0;
+    uint64_t packetsReceived = 0;
+    uint64_t retransmits = 0;
+    uint64_t duplicates = 0; // packets for a block that was already handled
+    uint64_t blocks = 0;
+    uint64_t bytes = 0;
+    std::chrono::nanoseconds firstBlockTime{0}; // from the first packet sent until the first block got through
+    std::chrono::nanoseconds duration{0};       // from the first packet sent until the transfer ended
+};
+
+// The retransmission timer and error handling common to both directions
+template <typename Transport, typename Clock>
+class TransferEngine
+{
+public:
+    TransferState state() const { return currentState; }
+    int errorCode() const { return failureCode; }
+    const std::string &errorMessage() const { return failureMessage; }
+    bool failedByPeer() const { return peerError; }
+    const TransferStats &stats() const { return counters; }
+
+    // When onTimeout() is due. Far in the future once the transfer has ended.
+    typename Clock::time_point deadline() const { return timer; }
+
+    // Running, or complete but still dallying to answer a retransmitted last block
+    bool active() const { return currentState == TransferState::Running || timer != Clock::time_point::max(); }
+
+    // Retransmit the last packet, or give up after MAX_RETRY_COUNT retransmissions
+    void onTimeout()
+    {
+        // The end of the dally period
+        if (currentState != TransferState::Running)
+        {
+            timer = Clock::time_point::max();
+            return;
+        }
+
+        if (retries >= MAX_RETRY_COUNT)
+        {
+            fail(TFTP_ERROR_TIMEOUT, "Transfer timed out", false);
+            return;
+        }
+        retries++;
+        counters.retransmits++;
+        transmit();
+    }
+
+    // Stop the transfer because the transport failed underneath it
+    void abort(int errorCode, const std::string &errorMessage)
+    {
+        if (currentState != TransferState::Running)
+            timer = Clock::time_point::max();
+        fail(errorCode, errorMessage, false);
+    }
+
+protected:
+    TransferEngine(Transport &transport, Clock &clock) : transport(transport), clock(clock) {}
+
+    // Send lastPacket and restart the timer
+    void transmit()
+    {
+        if (counters.packetsSent == 0)
+            startedAt = clock.now();
+        counters.packetsSent++;
+        if (!transport.send(&lastPacket, lastLength))
+        {
+            fail(TFTP_ERROR_TRANSPORT, "Unable to send packet", false);
+            return;
+        }
+        if (currentState == TransferState::Running)
+            timer = clock.now() + std::chrono::seconds(TIME_OUT);
+        else if (timer != Clock::time_point::max())
+            timer = clock.now() + std::chrono::milliseconds(DALLY_TIME_MS);
+    }
+
+    // Send a new packet that the peer has not seen yet
+    void transmitNew(size_t length)
+    {
+        lastLength = length;
+        retries = 0;
+        transmit();
+    }
+
+    // A block was stored by the receiver or acknowledged to the sender
+    void countBlock(size_t length)
+    {
+        counters.blocks++;
+        counters.bytes += length;
+        if (counters.blocks == 1)
+            counters.firstBlockTime = clock.now() - startedAt;
+    }
+
+    // With dally the engine stays active() for DALLY_TIME_MS, restarted by every packet it sends meanwhile
+    void finish(bool dally = false)
+    {
+        currentState = TransferState::Complete;
+        timer = dally ? clock.now() + std::chrono::milliseconds(DALLY_TIME_MS) : Clock::time_point::max();
+        counters.duration = clock.now() - startedAt;
+    }
+
+    void fail(int errorCode, const std::string &errorMessage, bool notifyPeer)
+    {
+        if (currentState != TransferState::Running)
+            return;
+
+        currentState = TransferState::Failed;
+        failureCode = errorCode;
+        failureMessage = errorMessage;
+        timer = Clock::time_point::max();
+        if (counters.packetsSent > 0)
+            counters.duration = clock.now() - startedAt;
+
+        if (notifyPeer)
+        {
+            size_t length = buildErrorPacket(lastPacket, errorCode, errorMessage);
+            counters.packetsSent++;
+            transport.send(&lastPacket, length);
+        }
+    }
+
+    // An ERROR from the peer ends the transfer without a reply
+    void failFromPeer(const TftpPacketUnion &packet, size_t length)
+    {
+        if (currentState != TransferState::Running)
+            return;
+
+        std::string message;
+        if (length > 4)
+            message.assign(packet.errorPacket.errorMessage, strnlen(packet.errorPacket.errorMessage, length - 4));
+        fail(length >= 4 ? ntohs(packet.errorPacket.errorCode) : TFTP_ERROR_NOT_DEFINED, message, false);
+        peerError = true;
+    }
+
+    Transport &transport;
+    Clock &clock;
+    TftpPacketUnion lastPacket; // kept for retransmission
+    size_t lastLength = 0;
+    TransferStats counters;
+
+private:
+    TransferState currentState = TransferState::Running;
+    typename Clock::time_point timer = Clock::time_point::max();
+    typename Clock::time_point startedAt{};
+    int retries = 0;
+    int failureCode = TFTP_ERROR_NOT_DEFINED;
+    std::string failureMessage;
+    bool peerError = false;
+};
+
+// Sends a file block by block. The block source fills a MAX_DATA_LEN buffer and returns the block length,
+// less than MAX_DATA_LEN for the last block, or -1 if the file cannot be read.
+template <typename Transport, typename Clock>
+class TftpSender : public TransferEngine<Transport, Clock>
+{
+public:
+    using BlockSource = std::function<ssize_t(char *)>;
+
+    TftpSender(Transport &transport, Clock &clock, BlockSource source)
+        : TransferEngine<Transport, Clock>(transport, clock), source(std::move(source)) {}
+
+    // Answer an RRQ that has already been accepted by sending block 1
+    void start()
+    {
+        blockNumber = 0;
+        sendNextBlock();
+    }
+
+    // Send a WRQ and start with block 1 once the peer acknowledges it with ACK 0
+    void startWithRequest(const char *filename)
+    {
+        blockNumber = 0;
+        this->transmitNew(buildRequestPacket(this->lastPacket, TFTP_WRQ, filename));
+    }
+
+    void onPacket(const TftpPacketUnion &packet, size_t length)
+    {
+        if (this->state() != TransferState::Running || length < 4)
+            return;
+        this->counters.packetsReceived++;
+
+        uint16_t opcode = ntohs(packet.packet.opcode);
+        if (opcode == TFTP_ERROR)
+        {
+            this->failFromPeer(packet, length);
+            return;
+        }
+        // A retransmitted request is answered by our own retransmission timer
+        if (opcode == TFTP_RRQ || opcode == TFTP_WRQ)
+            return;
+        if (opcode != TFTP_ACK)
+        {
+            this->fail(TFTP_ERROR_ILLEGAL_OPERATION, "Illegal opcode", true);
+            return;
+        }
+
+        // Only the ACK for the outstanding block moves the transfer on. Answering duplicates would
+        // double every packet from then on (Sorcerer's Apprentice), so they are ignored.
+        if (ntohs(packet.ackPacket.blockNumber) != blockNumber)
+        {
+            this->counters.duplicates++;
+            return;
+        }
+
+        if (sentAnyBlock)
+        {
+            this->countBlock(lastDataLength);
+            if (lastDataLength < MAX_DATA_LEN)
+            {
+                this->finish();
+                return;
+            }
+        }
+        sendNextBlock();
+    }
+
+private:
+    void sendNextBlock()
+    {
+        TftpDataPacket &dataPacket = this->lastPacket.dataPacket;
+        ssize_t bytesRead = source(dataPacket.data);
+        if (bytesRead < 0)
+        {
+            this->fail(TFTP_ERROR_NOT_DEFINED, "Error reading file", true);
+            return;
+        }
+
+        blockNumber++;
+        sentAnyBlock = true;
+        lastDataLength = bytesRead;
+        dataPacket.opcode = htons(TFTP_DATA);
+        dataPacket.blockNumber = htons(blockNumber);
+        this->transmitNew(4 + bytesRead);
+    }
+
+    BlockSource source;
+    uint16_t blockNumber = 0; // block awaiting its ACK, wraps after 65535
+    bool sentAnyBlock = false;
+    size_t lastDataLength = 0;
+};
+
+// Receives a file block by block. The block sink is handed each new block once, including an empty last
+// block, and returns false if it could not store it.
+template <typename Transport, typename Clock>
+class TftpReceiver : public TransferEngine<Transport, Clock>
+{
+public:
+    using BlockSink = std::function<bool(const char *, size_t)>;
+
+    TftpReceiver(Transport &transport, Clock &clock, BlockSink sink)
+        : TransferEngine<Transport, Clock>(transport, clock), sink(std::move(sink)) {}
+
+    // Accept a WRQ that has already been checked by sending ACK 0
+    void start()
+    {
+        expectedBlock = 1;
+        sendAck(0);
+    }
+
+    // Send an RRQ, which is retransmitted until block 1 arrives
+    void startWithRequest(const char *filename)
+    {
+        expectedBlock = 1;
+        this->transmitNew(buildRequestPacket(this->lastPacket, TFTP_RRQ, filename));
+    }
+
+    void onPacket(const TftpPacketUnion &packet, size_t length)
+    {
+        if (this->state() == TransferState::Failed || length < 4)
+            return;
+        this->counters.packetsReceived++;
+
+        uint16_t opcode = ntohs(packet.packet.opcode);
+        if (opcode == TFTP_ERROR)
+        {
+            this->failFromPeer(packet, length);
+            return;
+        }
+        if (opcode == TFTP_RRQ || opcode == TFTP_WRQ)
+            return;
+        if (opcode != TFTP_DATA)
+        {
+            this->fail(TFTP_ERROR_ILLEGAL_OPERATION, "Illegal opcode", true);
+            return;
+        }
+        if (length > 4 + MAX_DATA_LEN)
+        {
+            this->fail(TFTP_ERROR_ILLEGAL_OPERATION, "Data block too long", true);
+            return;
+        }
+
+        uint16_t blockNumber = ntohs(packet.dataPacket.blockNumber);
+        if (blockNumber != expectedBlock)
+        {
+            // Our ACK for the previous block was lost, acknowledge it again
+            this->counters.duplicates++;
+            if (blockNumber == static_cast<uint16_t>(expectedBlock - 1))
+            {
+                this->counters.retransmits++;
+                this->transmit();
+            }
+            return;
+        }
+        if (this->state() != TransferState::Running)
+            return;
+
+        size_t dataLength = length - 4;
+        if (!sink(packet.dataPacket.data, dataLength))
+        {
+            this->fail(TFTP_ERROR_DISK_FULL, "Unable to write file", true);
+            return;
+        }
+        this->countBlock(dataLength);
+
+        sendAck(expectedBlock);
+        expectedBlock++;
+        if (dataLength < MAX_DATA_LEN)
+            this->finish(true);
+    }
+
+private:
+    void sendAck(uint16_t blockNumber)
+    {
+        TftpAckPacket &ackPacket = this->lastPacket.ackPacket;
+        ackPacket.opcode = htons(TFTP_ACK);
+        ackPacket.blockNumber = htons(blockNumber);
+        this->transmitNew(sizeof(TftpAckPacket));
+    }
+
+    BlockSink sink;
+    uint16_t expectedBlock = 1;
+};
+
+// Clock policy backed by std::chrono::steady_clock
+struct SteadyClock
+{
+    using time_point = std::chrono::steady_clock::time_point;
+    time_point now() const { return std::chrono::steady_clock::now(); }
+};
+
+// Drive an engine over a blocking transport until the transfer completes or fails.
+// Returns true if it completed.
+template <typename Engine, typename Transport>
+bool runTransfer(Engine &engine, Transport &transport)
+{
+    TftpPacketUnion packet;
+    while (engine.active())
+    {
+        ssize_t length = transport.receive(packet, engine.deadline());
+        if (length == TRANSPORT_TIMEOUT)
+            engine.onTimeout();
+        else if (length < 0)
+            engine.abort(TFTP_ERROR_TRANSPORT, "Unable to receive packet");
+        else
+            engine.onPacket(packet, length);
+    }
+    return engine.state() == TransferState::Complete;
+}
+
+#endif